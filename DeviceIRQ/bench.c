@@ -0,0 +1,44 @@
+#include "types.h"
+#include "syscalls.h"
+
+uint64 syscall(uint64 nr, uint64 param) {
+    uint64 retval;
+
+    asm volatile("mv a7, %0" : : "r" (nr) : );
+    asm volatile("mv a0, %0" : : "r" (param) : );
+
+    // here's our ecall!
+    asm volatile("ecall");
+
+    // Here we return the return value...
+    asm volatile("mv %0, a0" : "=r" (retval) : : );
+    return retval;
+}
+
+void printastring(char *s) {
+    syscall(PRINTASTRING, (uint64)s);
+}
+
+// ----
+
+// Synthetic CPU-bound workload for the scheduler benchmarks. Every copy
+// runs a fixed number of work units and then prints the kernel's scheduler
+// counters, so throughput is (copies * UNITS) / mtime at the last report.
+// make bench SMP=n loads five copies next to user1-3.
+
+#define UNITS 64
+#define UNITSIZE (1 << 20)
+
+int main(void) {
+    volatile uint64 x = 1;
+
+    printastring("bench: start\n");
+    for (int u = 0; u < UNITS; u++) {
+      for (int i = 0; i < UNITSIZE; i++)
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    printastring("bench: done\n");
+    syscall(SCHEDSTATS, 0);
+    syscall(EXIT, 0);
+    return 0;
+}
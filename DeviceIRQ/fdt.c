@@ -0,0 +1,353 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Flattened device tree parser. qemu passes the address of the FDT blob in
+// a1 at boot. We walk its structure block once, without allocating anything,
+// into a copy of bootinfo that replaces it only if the walk got to the end.
+// Where the tree has no answer, or there is no usable tree, the qemu virt
+// defaults stay. Nodes nested deeper than FDT_MAXDEPTH are skipped. The
+// blob is not trusted: every read is checked against its totalsize.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+#define FDT_MAXDEPTH 8
+
+typedef struct {
+  uint32 magic;
+  uint32 totalsize;
+  uint32 off_dt_struct;
+  uint32 off_dt_strings;
+  uint32 off_mem_rsvmap;
+  uint32 version;
+  uint32 last_comp_version;
+  uint32 boot_cpuid_phys;
+  uint32 size_dt_strings;
+  uint32 size_dt_struct;
+} fdt_header;
+
+bootinfo boot = {
+  .ram_base = 0x80000000ULL,
+  .ram_size = 128 * 1024 * 1024,
+  .nharts = NCPU, // every hart that starts, see setup
+  .timebase = 10000000,
+  .clint = 0x2000000L,
+  .plic = 0x0c000000L,
+  .uart = 0x10000000L,
+  .uart_irq = 10,
+  .mem = {{ 0x80000000ULL, 128 * 1024 * 1024, 0 }},
+  .nmem = 1,
+};
+
+uint64 clint_base = 0x2000000L;
+uint64 plic_base = 0x0c000000L;
+uint64 tick_interval = 2000;
+
+// the FDT is big endian
+static uint32 be32(const void *p) {
+  const uint8_t *b = p;
+  return ((uint32)b[0] << 24) | ((uint32)b[1] << 16) | ((uint32)b[2] << 8) | b[3];
+}
+
+// read a number of ncells 32 bit cells
+static uint64 cells(const uint8_t *p, int ncells) {
+  uint64 x = 0;
+  for (int i=0; i<ncells; i++)
+    x = (x << 32) | be32(p + 4*i);
+  return x;
+}
+
+static int streq(const char *a, const char *b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+static int strprefix(const char *s, const char *prefix) {
+  while (*prefix && *s == *prefix) {
+    s++;
+    prefix++;
+  }
+  return *prefix == 0;
+}
+
+// does the stringlist property value (NUL separated) contain s?
+static int strlist_has(const char *list, int len, const char *s) {
+  for (int i=0; i<len; ) {
+    if (streq(list + i, s))
+      return 1;
+    while (i < len && list[i])
+      i++;
+    i++;
+  }
+  return 0;
+}
+
+// does the ISA string (rv64imac_zicsr_svnapot...) name the multi-letter
+// extension ext?
+static int isa_has(const char *isa, const char *ext) {
+  while (*isa) {
+    if (*isa++ != '_')
+      continue;
+    const char *e = ext;
+    while (*e && *isa == *e) {
+      isa++;
+      e++;
+    }
+    if (*e == 0 && (*isa == 0 || *isa == '_'))
+      return 1;
+  }
+  return 0;
+}
+
+// what we remember about a node until its end
+typedef struct {
+  uint32 acells, scells; // #address-cells/#size-cells for its children
+  uint64 addr, size;   // first reg entry
+  int irq;             // first interrupts cell, -1 if none
+  int kind;
+  int okay;            // status is absent or "okay"
+  uint32 numa;         // numa-node-id
+  int svnapot;         // a cpu whose ISA string lists Svnapot
+} fdt_node;
+
+enum { N_OTHER, N_MEMORY, N_CPU, N_UART, N_CLINT, N_PLIC };
+
+static int napotharts; // harts with Svnapot
+
+// a node ends: record it in b, if it is one of ours
+static void fdt_commit(bootinfo *b, fdt_node *n) {
+  if (!n->okay)
+    return;
+  switch (n->kind) {
+  case N_MEMORY:
+    if (b->nmem < NMEMRANGE) {
+      b->mem[b->nmem].base = n->addr;
+      b->mem[b->nmem].size = n->size;
+      b->mem[b->nmem].node = n->numa;
+      b->nmem++;
+    }
+    break;
+  case N_CPU:
+    b->nharts++;
+    napotharts += n->svnapot;
+    if (n->addr < NCPU)
+      b->hartnode[n->addr] = n->numa;
+    break;
+  case N_UART:
+    b->uart = n->addr;
+    if (n->irq >= 0)
+      b->uart_irq = n->irq;
+    break;
+  case N_CLINT:
+    b->clint = n->addr;
+    break;
+  case N_PLIC:
+    b->plic = n->addr;
+    break;
+  }
+}
+
+// parse the FDT at dtb into boot. returns -1, and leaves boot alone, if
+// there is none, it is cut short or something in it points outside of it.
+int fdt_parse(uint64 dtb) {
+  fdt_header *h = (fdt_header *)dtb;
+  fdt_node stack[FDT_MAXDEPTH + 1];
+  bootinfo b = boot;
+  int depth = 0;
+  int skip = 0;     // levels of a subtree too deep for the stack
+  int in_cpus = 0;  // below /cpus
+  int uarts = 0;    // the first UART is the console
+  uint32 size, off_struct, off_strings;
+
+  if (dtb == 0 || be32(&h->magic) != FDT_MAGIC)
+    return -1;
+  size = be32(&h->totalsize);
+  off_struct = be32(&h->off_dt_struct);
+  off_strings = be32(&h->off_dt_strings);
+  if (size < sizeof(fdt_header) || off_struct >= size || off_strings >= size)
+    return -1;
+  b.fdt = dtb;
+  b.fdt_size = size;
+
+  const uint8_t *p = (const uint8_t *)dtb + off_struct;
+  const uint8_t *end = (const uint8_t *)dtb + size;
+  const char *strings = (const char *)dtb + off_strings;
+  uint32 strsize = size - off_strings;
+
+  // the values of the root's parent, as the spec gives them
+  stack[0].acells = 2;
+  stack[0].scells = 1;
+  b.nmem = 0;
+  b.nharts = 0;
+  napotharts = 0;
+
+  while (1) {
+    if (end - p < 4)
+      return -1;
+    uint32 token = be32(p);
+    p += 4;
+
+    if (token == FDT_BEGIN_NODE) {
+      const char *name = (const char *)p;
+      uint64 len = 0;
+      while (len < end - p && name[len])
+        len++;
+      if (end - p < ((len + 4) & ~3))
+        return -1;
+      p += (len + 4) & ~3; // name, NUL and padding
+
+      if (skip || depth == FDT_MAXDEPTH) {
+        skip++;
+        continue;
+      }
+      depth++;
+      fdt_node *n = &stack[depth];
+      n->acells = 2;
+      n->scells = 1;
+      n->addr = n->size = 0;
+      n->irq = -1;
+      n->kind = N_OTHER;
+      n->okay = 1;
+      n->numa = 0;
+      n->svnapot = 0;
+      if (depth == 2 && streq(name, "cpus"))
+        in_cpus = 1;
+      // older trees only name memory nodes
+      if (depth == 2 && strprefix(name, "memory"))
+        n->kind = N_MEMORY;
+    } else if (token == FDT_END_NODE) {
+      if (skip) {
+        skip--;
+        continue;
+      }
+      if (depth == 0)
+        return -1;
+      if (depth == 2)
+        in_cpus = 0;
+      fdt_commit(&b, &stack[depth]);
+      depth--;
+      if (depth == 0)
+        break;
+    } else if (token == FDT_PROP) {
+      if (end - p < 8)
+        return -1;
+      uint32 len = be32(p);
+      uint32 nameoff = be32(p + 4);
+      const uint8_t *val = p + 8;
+      if (len > end - val || (uint64)((len + 3) & ~3) > end - val || nameoff >= strsize)
+        return -1;
+      p = val + ((len + 3) & ~3);
+
+      if (skip || depth == 0)
+        continue;
+      fdt_node *n = &stack[depth];
+      fdt_node *parent = &stack[depth - 1];
+
+      // the name must end inside the strings block, string values inside
+      // the value
+      const char *pname = strings + nameoff;
+      uint32 i = 0;
+      while (nameoff + i < strsize && pname[i])
+        i++;
+      if (nameoff + i == strsize)
+        return -1;
+      int str = len > 0 && val[len - 1] == 0;
+
+      if (streq(pname, "#address-cells")) {
+        if (len >= 4)
+          n->acells = be32(val);
+      } else if (streq(pname, "#size-cells")) {
+        if (len >= 4)
+          n->scells = be32(val);
+      } else if (streq(pname, "reg")) {
+        if (parent->acells <= 2 && parent->scells <= 2 &&
+            len >= 4 * (parent->acells + parent->scells)) {
+          n->addr = cells(val, parent->acells);
+          n->size = cells(val + 4 * parent->acells, parent->scells);
+        }
+      } else if (streq(pname, "interrupts")) {
+        if (len >= 4)
+          n->irq = be32(val);
+      } else if (streq(pname, "status")) {
+        n->okay = str && (streq((const char *)val, "okay") || streq((const char *)val, "ok"));
+      } else if (streq(pname, "numa-node-id")) {
+        if (len >= 4)
+          n->numa = be32(val);
+      } else if (streq(pname, "timebase-frequency") && in_cpus) {
+        if (len >= 4)
+          b.timebase = len == 8 ? cells(val, 2) : be32(val);
+      } else if (!str) {
+        continue; // the rest are strings
+      } else if (streq(pname, "riscv,isa")) {
+        n->svnapot = isa_has((const char *)val, "svnapot");
+      } else if (streq(pname, "riscv,isa-extensions")) {
+        n->svnapot = strlist_has((const char *)val, len, "svnapot");
+      } else if (streq(pname, "device_type")) {
+        if (streq((const char *)val, "memory"))
+          n->kind = N_MEMORY;
+        else if (streq((const char *)val, "cpu"))
+          n->kind = N_CPU;
+      } else if (streq(pname, "compatible")) {
+        const char *c = (const char *)val;
+        if (strlist_has(c, len, "ns16550a") && uarts++ == 0)
+          n->kind = N_UART;
+        else if (strlist_has(c, len, "riscv,clint0") || strlist_has(c, len, "sifive,clint0"))
+          n->kind = N_CLINT;
+        else if (strlist_has(c, len, "riscv,plic0") || strlist_has(c, len, "sifive,plic-1.0.0"))
+          n->kind = N_PLIC;
+      }
+    } else if (token == FDT_NOP) {
+      continue;
+    } else {
+      return -1; // FDT_END before the root ended, or garbage
+    }
+  }
+
+  // keep the defaults for what the tree did not tell us
+  if (b.nmem == 0) {
+    b.mem[0].base = b.ram_base;
+    b.mem[0].size = b.ram_size;
+    b.nmem = 1;
+  }
+  // Svnapot PTEs are only usable if whichever hart runs a process has it;
+  // misa has no bit for it, so a tree that does not say means no
+  b.svnapot = b.nharts > 0 && napotharts == b.nharts;
+  if (b.nharts == 0)
+    b.nharts = boot.nharts;
+
+  // main memory is the range the kernel was loaded into
+  for (int i=0; i<b.nmem; i++) {
+    if (b.mem[i].base <= 0x80000000ULL && 0x80000000ULL < b.mem[i].base + b.mem[i].size) {
+      b.ram_base = b.mem[i].base;
+      b.ram_size = b.mem[i].size;
+    }
+  }
+  boot = b;
+
+  clint_base = boot.clint;
+  plic_base = boot.plic;
+  tick_interval = boot.timebase / TICK_HZ;
+
+#ifdef DEBUG
+  printastring("fdt: ram "); printhex(boot.ram_base); printastring(" size "); printhex(boot.ram_size);
+  printastring(" harts "); printhex(boot.nharts);
+  printastring(" timebase "); printhex(boot.timebase);
+  printastring(" uart "); printhex(boot.uart); printastring(" irq "); printhex(boot.uart_irq);
+  printastring(" svnapot "); printhex(boot.svnapot);
+  printastring("\n");
+#endif
+  return 0;
+}
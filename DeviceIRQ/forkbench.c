@@ -0,0 +1,58 @@
+#include "types.h"
+#include "syscalls.h"
+
+extern uint64 syscall(uint64 nr, uint64 param, uint64 param2, uint64 param3);
+extern void printastring(char *s);
+extern void printhex(uint64 x);
+extern uint64 rdtime(void);
+
+// Fork latency microbenchmark. The process makes 2 MB of bss resident and
+// forks ROUNDS times. The parent prints the mtime ticks every FORK took,
+// which is page table work only: the 2 MB are shared copy-on-write. Each
+// child then stores to every page, so each is copied on its first store,
+// prints how long that took and exits. The VMSTATS dump at the end counts
+// the copies.
+
+#define SIZE 0x200000
+#define PAGES (SIZE / 4096)
+#define ROUNDS 8
+
+char buf[SIZE];
+
+void touch(char v) {
+    for (int p = 0; p < PAGES; p++)
+      buf[p * 4096] = v;
+}
+
+int main(void) {
+    touch(1);
+
+    for (int r = 0; r < ROUNDS; r++) {
+      uint64 start = rdtime();
+      uint64 pid = syscall(FORK, 0, 0, 0);
+      uint64 t = rdtime() - start;
+
+      if (pid == 0) {
+        start = rdtime();
+        touch(2);
+        t = rdtime() - start;
+        printastring("forkbench: child copy-on-write stores ");
+        printhex(t);
+        printastring("\n");
+        syscall(EXIT, 0, 0, 0);
+      }
+      if (pid == (uint64)-1) {
+        // all process slots busy: let the children finish
+        syscall(YIELD, 0, 0, 0);
+        r--;
+        continue;
+      }
+      printastring("forkbench: fork ");
+      printhex(t);
+      printastring("\n");
+      syscall(YIELD, 0, 0, 0);
+    }
+    syscall(VMSTATS, 0, 0, 0);
+    syscall(EXIT, 0, 0, 0);
+    return 0;
+}
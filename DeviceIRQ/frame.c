@@ -0,0 +1,523 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Physical memory: a buddy allocator per NUMA node. Memory is handed out in
+// blocks of 2^order pages, order 0 (4 KB) up to MAXORDER (1 GB); a block is
+// aligned to its size, and its buddy is the other half of the block of the
+// next order. Freeing a block merges it with its buddy for as long as that
+// is free as well.
+//
+// Every memory range of the device tree is a zone with a pageinfo per page,
+// which lives at the start of the zone. The zones of a node share its free
+// lists. Single pages - most allocations - go through a small per-hart
+// cache of pages of the hart's node, which only takes the node's lock to
+// refill or drain it in batches.
+//
+// An allocation asks for a node and falls back to the other nodes, in
+// order, when that node has no block of that size left.
+//
+// frame_alloc hands out zeroed pages. Clearing them in the page fault path
+// adds to its latency, so every node also keeps a pool of pages cleared
+// beforehand by its idle harts: once it drops below ZPOOL_LOW they fill it
+// up to ZPOOL_HIGH, until an interrupt needs them. When memory runs out
+// the pools are given back. Building with -DNOZEROPOOL leaves the pools
+// empty, so every page is cleared when it is allocated; this is the
+// baseline to hold forkbench and heapbench against.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+extern char end[];
+extern cpu cpus[NCPU];
+extern pcbentry pcb[MAXPROCS];
+
+// free block, linked through its first page
+typedef struct freeblock {
+  struct freeblock *next, *prev;
+} freeblock;
+
+typedef struct __attribute__((aligned(CACHELINE))) {
+  ticketlock lock;
+  freeblock *free[MAXORDER + 1];
+  uint64 nfree[MAXORDER + 1]; // free blocks of each order
+  uint64 frames;      // pages the node has
+  uint64 freepages;
+  uint64 local;       // allocations for this node served here
+  uint64 remote;      // allocations for this node served by another node
+  ticketlock zlock;   // for the pool of zeroed pages
+  int nzero;
+  uint64 zpages[ZPOOL_HIGH];
+  uint64 zhits;       // frame_alloc served from the pool
+  uint64 zmisses;     // frame_alloc had to clear the page itself
+} framepool;
+
+typedef struct {
+  uint64 base, end;
+  pageinfo *map;      // one per page of [base, end)
+  int node;
+} zone;
+
+framepool pools[NNODE];
+int nnodes = 1;
+zone zones[NMEMRANGE];
+int nzones;
+
+static zone *zone_of(uint64 pa) {
+  for (int i=0; i<nzones; i++)
+    if (pa >= zones[i].base && pa < zones[i].end)
+      return &zones[i];
+  return 0;
+}
+
+pageinfo *page_info(uint64 pa) {
+  zone *z = zone_of(pa);
+  return z ? &z->map[(pa - z->base) / PGSIZE] : 0;
+}
+
+// node of the memory frame pa is in
+int frame_node(uint64 pa) {
+  zone *z = zone_of(pa);
+  return z ? z->node : 0;
+}
+
+static void list_push(framepool *p, uint64 pa, int order) {
+  freeblock *b = (freeblock *)pa;
+
+  b->prev = 0;
+  b->next = p->free[order];
+  if (b->next)
+    b->next->prev = b;
+  p->free[order] = b;
+  p->nfree[order]++;
+}
+
+static void list_remove(framepool *p, uint64 pa, int order) {
+  freeblock *b = (freeblock *)pa;
+
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    p->free[order] = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  p->nfree[order]--;
+}
+
+// put the block at pa back, merged with its free buddies. Node lock held.
+static void block_free(zone *z, uint64 pa, int order) {
+  framepool *p = &pools[z->node];
+
+  p->freepages += 1ULL << order;
+  while (order < MAXORDER) {
+    uint64 buddy = pa ^ (PGSIZE << order);
+    pageinfo *bi;
+
+    if (buddy < z->base || buddy + (PGSIZE << order) > z->end)
+      break;
+    bi = &z->map[(buddy - z->base) / PGSIZE];
+    if (!bi->free || bi->order != order)
+      break;
+    list_remove(p, buddy, order);
+    bi->free = 0;
+    if (buddy < pa)
+      pa = buddy;
+    order++;
+  }
+  pageinfo *pi = &z->map[(pa - z->base) / PGSIZE];
+  pi->free = 1;
+  pi->order = order;
+  list_push(p, pa, order);
+}
+
+// take a block of 2^order pages from node's free lists, splitting a larger
+// one if need be. returns 0 if there is none. Node lock held.
+static uint64 block_alloc(int node, int order) {
+  framepool *p = &pools[node];
+  int o = order;
+
+  while (o <= MAXORDER && p->free[o] == 0)
+    o++;
+  if (o > MAXORDER)
+    return 0;
+  uint64 pa = (uint64)p->free[o];
+  list_remove(p, pa, o);
+  zone *z = zone_of(pa);
+
+  // hand the upper halves back until the block has the size we want
+  while (o > order) {
+    o--;
+    uint64 half = pa + (PGSIZE << o);
+    pageinfo *hi = &z->map[(half - z->base) / PGSIZE];
+    hi->free = 1;
+    hi->order = o;
+    list_push(p, half, o);
+  }
+  pageinfo *pi = &z->map[(pa - z->base) / PGSIZE];
+  pi->free = 0;
+  pi->order = order;
+  pi->refs = 1;
+  p->freepages -= 1ULL << order;
+  return pa;
+}
+
+// hand [start, stop) to the allocator, in the largest aligned blocks it
+// can be cut into
+void frame_add(uint64 start, uint64 stop) {
+  start = PGROUNDUP(start);
+  stop = PGROUNDDOWN(stop);
+  while (start < stop) {
+    zone *z = zone_of(start);
+    if (z == 0)
+      return;
+    int order = 0;
+    while (order < MAXORDER && (start & ((PGSIZE << (order+1)) - 1)) == 0 &&
+           start + (PGSIZE << (order+1)) <= stop && start + (PGSIZE << (order+1)) <= z->end)
+      order++;
+    framepool *p = &pools[z->node];
+    ticket_acquire(&p->lock);
+    block_free(z, start, order);
+    ticket_release(&p->lock);
+    start += PGSIZE << order;
+  }
+}
+
+// set up a zone for every memory range of the device tree and hand it all
+// to the allocator, except the kernel, the process slots the loader filled
+// (setup() adds those once it copied the programs out) and the FDT.
+void frame_init(void) {
+  uint64 reserved = boot.ram_base + 0x200000ULL * (MAXPROCS + 1);
+
+  if ((uint64)end > reserved)
+    reserved = (uint64)end;
+  for (int n=0; n<NNODE; n++) {
+    pools[n].lock = (ticketlock)TICKETLOCK_INIT("frames");
+    pools[n].zlock = (ticketlock)TICKETLOCK_INIT("zeroed frames");
+  }
+
+  for (int i=0; i<boot.nmem; i++) {
+    zone *z = &zones[nzones];
+    uint64 first;
+
+    z->base = PGROUNDUP(boot.mem[i].base);
+    z->end = PGROUNDDOWN(boot.mem[i].base + boot.mem[i].size);
+    z->node = boot.mem[i].node < NNODE ? boot.mem[i].node : 0;
+    if (z->base >= z->end)
+      continue;
+    if (z->node + 1 > nnodes)
+      nnodes = z->node + 1;
+
+    // the pageinfo array takes the first free pages of the zone
+    first = z->base;
+    if (first < reserved && reserved <= z->end)
+      first = reserved;
+    z->map = (pageinfo *)first;
+    first = PGROUNDUP(first + (z->end - z->base) / PGSIZE * sizeof(pageinfo));
+    if (first >= z->end)
+      continue;
+    for (uint64 k=0; k<(z->end - z->base) / PGSIZE; k++) {
+      z->map[k].refs = 0;
+      z->map[k].free = 0;
+      z->map[k].order = 0;
+    }
+    pools[z->node].frames += (z->end - first) / PGSIZE;
+    nzones++;
+
+    if (boot.fdt && boot.fdt < z->end && boot.fdt + boot.fdt_size > first) {
+      frame_add(first, boot.fdt);
+      frame_add(boot.fdt + boot.fdt_size, z->end);
+    } else {
+      frame_add(first, z->end);
+    }
+  }
+}
+
+// count an allocation for node, served by node n
+static void frame_count(int node, int n, int pages) {
+  __atomic_fetch_add(n == node ? &pools[node].local : &pools[node].remote, pages, __ATOMIC_RELAXED);
+}
+
+// give the zeroed pages of all pools back to the free lists. returns how
+// many there were.
+static int zero_drain(void) {
+  int drained = 0;
+
+  for (int n=0; n<nnodes; n++) {
+    framepool *p = &pools[n];
+    ticket_acquire(&p->zlock);
+    ticket_acquire(&p->lock);
+    while (p->nzero > 0) {
+      uint64 pa = p->zpages[--p->nzero];
+      block_free(zone_of(pa), pa, 0);
+      drained++;
+    }
+    ticket_release(&p->lock);
+    ticket_release(&p->zlock);
+  }
+  return drained;
+}
+
+// a block of 2^order pages from node, or the first of the other nodes
+// that has one. returns its physical address or 0.
+static uint64 block_alloc_any(int order, int node) {
+  for (int k=0; k<nnodes; k++) {
+    int n = (node + k) % nnodes;
+    ticket_acquire(&pools[n].lock);
+    uint64 pa = block_alloc(n, order);
+    ticket_release(&pools[n].lock);
+    if (pa) {
+      frame_count(node, n, 1 << order);
+      return pa;
+    }
+  }
+  return 0;
+}
+
+// allocate 2^order contiguous pages, from node if it has them. The pages
+// are not cleared. returns the physical address or 0.
+uint64 page_alloc(int order, int node) {
+  uint64 pa;
+
+  if (node < 0 || node >= nnodes)
+    node = 0;
+  if ((pa = block_alloc_any(order, node)) != 0)
+    return pa;
+  // the last resort: the zeroed pages, then one more try
+  if (zero_drain() == 0)
+    return 0;
+  return block_alloc_any(order, node);
+}
+
+// free a block of page_alloc
+void page_free(uint64 pa) {
+  zone *z = zone_of(pa);
+  framepool *p = &pools[z->node];
+
+  ticket_acquire(&p->lock);
+  block_free(z, pa, z->map[(pa - z->base) / PGSIZE].order);
+  ticket_release(&p->lock);
+}
+
+// turn a block of page_alloc into single pages, each to be freed with
+// frame_free on its own
+void page_split(uint64 pa) {
+  zone *z = zone_of(pa);
+  pageinfo *pi = &z->map[(pa - z->base) / PGSIZE];
+  int n = 1 << pi->order;
+
+  for (int i=0; i<n; i++) {
+    pi[i].order = 0;
+    pi[i].free = 0;
+    pi[i].refs = 1;
+  }
+}
+
+static void clear_page(uint64 pa) {
+  for (int i=0; i<PGSIZE/8; i++)
+    ((uint64 *)pa)[i] = 0;
+}
+
+// allocate a zeroed page, from node if it has one left. Pages of the node
+// of this hart come from its cache. returns the physical address or 0.
+uint64 frame_alloc(int node) {
+  pagecache *c = &mycpu()->pcache;
+  int mine = hart_node(mycpu()->hartid);
+  framepool *z;
+  uint64 pa = 0;
+
+  if (node < 0 || node >= nnodes)
+    node = 0;
+  z = &pools[node];
+  if (z->nzero > 0) {
+    ticket_acquire(&z->zlock);
+    if (z->nzero > 0)
+      pa = z->zpages[--z->nzero];
+    ticket_release(&z->zlock);
+  }
+  if (pa) {
+    page_info(pa)->refs = 1;
+    frame_count(node, node, 1);
+    __atomic_fetch_add(&z->zhits, 1, __ATOMIC_RELAXED);
+    return pa;
+  }
+  __atomic_fetch_add(&z->zmisses, 1, __ATOMIC_RELAXED);
+
+  if (node != mine)
+    goto slow;
+  if (c->n == 0) {
+    // refill half of the cache at once
+    framepool *p = &pools[mine];
+    ticket_acquire(&p->lock);
+    while (c->n < PCACHE / 2 && (pa = block_alloc(mine, 0)) != 0)
+      c->pages[c->n++] = pa;
+    ticket_release(&p->lock);
+    c->refills++;
+  }
+  if (c->n == 0)
+    goto slow;
+  pa = c->pages[--c->n];
+  page_info(pa)->refs = 1;
+  frame_count(node, node, 1);
+  clear_page(pa);
+  return pa;
+
+slow:
+  pa = page_alloc(0, node);
+  if (pa)
+    clear_page(pa);
+  return pa;
+}
+
+// give a page of frame_alloc back. Pages of this hart's node go into its
+// cache; a full cache is drained by half.
+void frame_free(uint64 pa) {
+  pagecache *c = &mycpu()->pcache;
+  int mine = hart_node(mycpu()->hartid);
+
+  page_info(pa)->refs = 0;
+  if (frame_node(pa) != mine) {
+    page_free(pa);
+    return;
+  }
+  if (c->n == PCACHE) {
+    framepool *p = &pools[mine];
+    ticket_acquire(&p->lock);
+    while (c->n > PCACHE / 2) {
+      uint64 old = c->pages[--c->n];
+      block_free(zone_of(old), old, 0);
+    }
+    ticket_release(&p->lock);
+  }
+  c->pages[c->n++] = pa;
+}
+
+// one more page table maps the page at pa, e.g. a child after FORK
+void frame_ref(uint64 pa) {
+  __atomic_fetch_add(&page_info(pa)->refs, 1, __ATOMIC_RELAXED);
+}
+
+// a page table no longer maps the page at pa. The last one frees it.
+void frame_put(uint64 pa) {
+  if (__atomic_sub_fetch(&page_info(pa)->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    frame_free(pa);
+}
+
+// called by an idle hart, without the kernel lock: if the pool of zeroed
+// pages of its node ran low, clear pages for it until it is full or an
+// interrupt is pending
+void frame_zero_idle(void) {
+  int n = hart_node(mycpu()->hartid);
+  framepool *p = &pools[n];
+
+#ifdef NOZEROPOOL
+  return;
+#endif
+  if (p->nzero >= ZPOOL_LOW)
+    return;
+  while (p->nzero < ZPOOL_HIGH && !(r_mip() & r_mie())) {
+    ticket_acquire(&p->lock);
+    uint64 pa = block_alloc(n, 0);
+    ticket_release(&p->lock);
+    if (pa == 0)
+      return;
+    clear_page(pa);
+    ticket_acquire(&p->zlock);
+    if (p->nzero < ZPOOL_HIGH) {
+      p->zpages[p->nzero++] = pa;
+      pa = 0;
+    }
+    ticket_release(&p->zlock);
+    if (pa) {
+      // another idle hart filled it first
+      page_free(pa);
+      return;
+    }
+  }
+}
+
+// NUMA node of the hart we run on
+int hart_node(int hart) {
+  return boot.hartnode[hart] < NNODE ? boot.hartnode[hart] : 0;
+}
+
+// node to allocate process pid's memory on: the one it was bound to with
+// SETNODE, else the node of the hart it runs on
+int proc_node(int pid) {
+  return pcb[pid].node >= 0 ? pcb[pid].node : hart_node(pcb[pid].hart);
+}
+
+// kernel objects live next to the hart that uses them
+uint64 kalloc(void) {
+  return frame_alloc(hart_node(mycpu()->hartid));
+}
+
+// SETNODE syscall: bind the memory of pid to node, -1 to follow its hart.
+// returns 0 or -1 if there is no such node.
+int frame_set_node(int pid, int node) {
+  if (node < -1 || node >= nnodes)
+    return -1;
+  pcb[pid].node = node;
+  return 0;
+}
+
+// per node: free pages by block order, and how much of the free memory is
+// in blocks too small for a 2 MB allocation - 0 = none, 0x64 = all of it
+void frame_stats(void) {
+  for (int n=0; n<nnodes; n++) {
+    framepool *p = &pools[n];
+    struct {
+      uint64 frames, freepages, local, remote, zhits, zmisses;
+      int nzero;
+      uint64 nfree[MAXORDER + 1];
+    } s;
+    uint64 small = 0;
+    int largest = -1;
+
+    // a consistent copy, printed after the lock is dropped again: the UART
+    // is far too slow to hold up allocations on the node meanwhile
+    ticket_acquire(&p->lock);
+    s.frames = p->frames;
+    s.freepages = p->freepages;
+    s.local = p->local;
+    s.remote = p->remote;
+    for (int o=0; o<=MAXORDER; o++)
+      s.nfree[o] = p->nfree[o];
+    ticket_release(&p->lock);
+    ticket_acquire(&p->zlock);
+    s.nzero = p->nzero;
+    s.zhits = p->zhits;
+    s.zmisses = p->zmisses;
+    ticket_release(&p->zlock);
+
+    printastring("node "); printhex(n);
+    printastring(" frames "); printhex(s.frames);
+    printastring(" free "); printhex(s.freepages);
+    printastring(" local allocs "); printhex(s.local);
+    printastring(" remote allocs "); printhex(s.remote);
+    printastring("\n  zeroed pages "); printhex(s.nzero);
+    printastring(" hits "); printhex(s.zhits);
+    printastring(" misses "); printhex(s.zmisses);
+    printastring("\n  free blocks by order:");
+    for (int o=0; o<=MAXORDER; o++) {
+      if (s.nfree[o]) {
+        printastring(" "); printhex(o); printastring(":"); printhex(s.nfree[o]);
+        largest = o;
+      }
+      if (o < 9)
+        small += s.nfree[o] << o;
+    }
+    printastring("\n  largest order "); printhex(largest);
+    printastring(" fragmentation "); printhex(s.freepages ? small * 100 / s.freepages : 0);
+    printastring("\n");
+  }
+  for (int h=0; h<NCPU; h++) {
+    if (!cpus[h].online)
+      continue;
+    printastring("hart "); printhex(h);
+    printastring(" cached pages "); printhex(cpus[h].pcache.n);
+    printastring(" refills "); printhex(cpus[h].pcache.refills);
+    printastring("\n");
+  }
+}
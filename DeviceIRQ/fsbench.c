@@ -0,0 +1,62 @@
+#include "types.h"
+#include "syscalls.h"
+
+uint64 syscall(uint64 nr, uint64 param, uint64 param2) {
+    uint64 retval;
+
+    asm volatile("mv a7, %0" : : "r" (nr) : );
+    asm volatile("mv a1, %0" : : "r" (param2) : );
+    asm volatile("mv a0, %0" : : "r" (param) : );
+
+    // here's our ecall!
+    asm volatile("ecall");
+
+    // Here we return the return value...
+    asm volatile("mv %0, a0" : "=r" (retval) : : );
+    return retval;
+}
+
+void printastring(char *s) {
+    syscall(PRINTASTRING, (uint64)s, 0);
+}
+
+void printhex(uint64 x) {
+    char s[19];
+
+    s[0] = '0';
+    s[1] = 'x';
+    for (int i = 0; i < 16; i++) {
+      int d = (x >> (60 - 4*i)) & 0xf;
+      s[2+i] = d < 10 ? d + '0' : d - 10 + 'a';
+    }
+    s[18] = 0;
+    printastring(s);
+}
+
+// ----
+
+// False sharing microbenchmark. Every copy has the kernel increment a
+// counter of its hart ITERS times, once with the counters of all harts
+// packed into one cache line and once with each on a line of its own, and
+// prints the mtime cycles both took. The copies start together at tick
+// START, so with one copy per hart the packed run makes the harts fight
+// over the line. make fsbench loads four copies at -smp 4.
+
+#define ITERS (1 << 20)
+#define ROUNDS 4
+#define START 5000
+
+int main(void) {
+    syscall(SLEEP, START, 0);
+    for (int r = 0; r < ROUNDS; r++) {
+      uint64 packed = syscall(FALSESHARE, 0, ITERS);
+      uint64 padded = syscall(FALSESHARE, 1, ITERS);
+      printastring("fsbench: packed ");
+      printhex(packed);
+      printastring(" padded ");
+      printhex(padded);
+      printastring("\n");
+    }
+    syscall(EXIT, 0, 0);
+    return 0;
+}
@@ -18,24 +18,35 @@ struct uart {
    uint8_t LSR; // R   = line status register (offset 5)
 };
 
+// The device addresses are qemu virt's; fdt_parse replaces them with the
+// ones the device tree gives at boot.
+extern uint64 clint_base, plic_base;
+
 // core local interruptor (CLINT), which contains the timer.
-#define CLINT 0x2000000L
+#define CLINT clint_base
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // write 1 to interrupt a hart
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
+static inline uint64
+r_mtime()
+{
+  return *(volatile uint64*)CLINT_MTIME;
+}
+
 // platform level interrupt controller (PLIC)
-#define PLIC 0x0c000000L
+#define PLIC plic_base
 #define PLIC_PRIORITY (PLIC + 0x0)
 #define PLIC_PENDING (PLIC + 0x1000)
-#define PLIC_MENABLE (PLIC + 0x2000)
-#define PLIC_SENABLE (PLIC + 0x2080)
-#define PLIC_MPRIORITY (PLIC + 0x200000)
-#define PLIC_SPRIORITY (PLIC + 0x201000)
-#define PLIC_MCLAIM (PLIC + 0x200004)
-#define PLIC_SCLAIM (PLIC + 0x201004)
-
-#define UART0_IRQ 10
+// every hart has an M-mode and an S-mode context
+#define PLIC_MENABLE(hart) (PLIC + 0x2000 + (hart)*0x100)
+#define PLIC_SENABLE(hart) (PLIC + 0x2080 + (hart)*0x100)
+#define PLIC_MPRIORITY(hart) (PLIC + 0x200000 + (hart)*0x2000)
+#define PLIC_SPRIORITY(hart) (PLIC + 0x201000 + (hart)*0x2000)
+#define PLIC_MCLAIM(hart) (PLIC + 0x200004 + (hart)*0x2000)
+#define PLIC_SCLAIM(hart) (PLIC + 0x201004 + (hart)*0x2000)
 
+#define MSI 3 // machine software interrupt
 #define MTI 7 // machine timer interrupt
 #define MEI 11 // machine external interrupt
 
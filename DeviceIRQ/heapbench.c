@@ -0,0 +1,53 @@
+#include "types.h"
+#include "syscalls.h"
+
+extern uint64 syscall(uint64 nr, uint64 param, uint64 param2, uint64 param3);
+extern void printastring(char *s);
+extern void printhex(uint64 x);
+extern uint64 rdtime(void);
+
+// Heap and anonymous memory. The program grows its heap by HEAP bytes with
+// BRK and touches one byte every 64 KB, then reserves MAP bytes with MMAP,
+// fills the first 2 MB (which the kernel then collapses into a megapage) and
+// gives the middle of it back with MUNMAP. It prints the mtime ticks per
+// first touch of a page; the VMSTATS dumps show that only touched pages
+// became resident and how the vma list changed.
+
+#define HEAP 0x1000000
+#define MAP 0x800000
+#define HUGE 0x200000
+
+int main(void) {
+    char *brk0 = (char *)syscall(BRK, 0, 0, 0);
+    uint64 start, n = 0;
+
+    if (syscall(BRK, (uint64)brk0 + HEAP, 0, 0) != (uint64)brk0 + HEAP) {
+      printastring("heapbench: brk failed\n");
+      syscall(EXIT, 0, 0, 0);
+    }
+    start = rdtime();
+    for (uint64 off = 0; off < HEAP; off += 0x10000, n++)
+      brk0[off] = 1;
+    printastring("heapbench: heap first touch ");
+    printhex((rdtime() - start) / n);
+    printastring("\n");
+
+    char *map = (char *)syscall(MMAP, 0, MAP, PROT_READ | PROT_WRITE);
+    if (map == (char *)-1) {
+      printastring("heapbench: mmap failed\n");
+      syscall(EXIT, 0, 0, 0);
+    }
+    start = rdtime();
+    for (uint64 off = 0; off < HUGE; off += 4096)
+      map[off] = 2;
+    printastring("heapbench: mmap first touch ");
+    printhex((rdtime() - start) / (HUGE / 4096));
+    printastring("\n");
+    syscall(VMSTATS, 0, 0, 0);
+
+    syscall(MUNMAP, (uint64)map + HUGE / 4, HUGE / 2, 0);
+    syscall(BRK, (uint64)brk0, 0, 0);
+    syscall(VMSTATS, 0, 0, 0);
+    syscall(EXIT, 0, 0, 0);
+    return 0;
+}
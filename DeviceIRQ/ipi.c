@@ -0,0 +1,52 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Inter-processor interrupts. A hart posts requests into the target's
+// mailbox (cpu.ipi_pending) and raises the target's machine software
+// interrupt through its CLINT MSIP register.
+
+extern cpu cpus[NCPU];
+
+void ipi_send(int hart, uint32 req) {
+  cpu *c = &cpus[hart];
+
+  // remember when the oldest outstanding reschedule was asked for
+  if ((req & IPI_RESCHED) && !(c->ipi_pending & IPI_RESCHED))
+    c->ipi_sent = r_mtime();
+  __atomic_fetch_or(&c->ipi_pending, req, __ATOMIC_RELEASE);
+  __sync_synchronize();
+  *(volatile uint32*)CLINT_MSIP(hart) = 1;
+}
+
+// make every idle hart look for work again
+void ipi_kick_idle(void) {
+  for (int h=0; h<NCPU; h++) {
+    if (cpus[h].online && cpus[h].pid < 0 && h != mycpu()->hartid)
+      ipi_send(h, IPI_RESCHED);
+  }
+}
+
+// called on the target hart before it takes the kernel lock, whose holder
+// may be waiting for us: acknowledge the software interrupt and serve the
+// requests that only touch this hart. returns the requests, so the caller can
+// reschedule under the kernel lock.
+uint32 ipi_receive(void) {
+  cpu *c = mycpu();
+
+  *(volatile uint32*)CLINT_MSIP(c->hartid) = 0;
+  uint32 pending = __atomic_exchange_n(&c->ipi_pending, 0, __ATOMIC_ACQ_REL);
+
+  if (pending & IPI_RESCHED) {
+    uint64 latency = r_mtime() - c->ipi_sent;
+    c->ipis++;
+    c->ipi_latency += latency;
+    if (latency > c->ipi_maxlatency)
+      c->ipi_maxlatency = latency;
+  }
+  if (pending & IPI_TLBFLUSH)
+    tlb_poll();
+  return pending;
+}
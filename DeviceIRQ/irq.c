@@ -0,0 +1,221 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Device interrupt routing. Every hart has its own M-mode PLIC context;
+// each interrupt source is enabled in exactly one of them, so only that hart
+// is interrupted and the others never race for the claim. A source may be
+// routed to any hart of its affinity mask. Route changes happen with the
+// kernel lock held.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+extern cpu cpus[NCPU];
+
+irqdesc irqs[NIRQ];
+
+// ask the PLIC what interrupt we should serve.
+static int
+plic_claim(void)
+{
+  return *(volatile uint32*)PLIC_MCLAIM(mycpu()->hartid);
+}
+
+// tell the PLIC we've served this IRQ.
+static void
+plic_complete(int irq)
+{
+  *(volatile uint32*)PLIC_MCLAIM(mycpu()->hartid) = irq;
+}
+
+static void plic_enable(int hart, int irq, int on) {
+  volatile uint32 *en = (volatile uint32*)PLIC_MENABLE(hart) + irq / 32;
+
+  if (on)
+    *en |= 1U << (irq % 32);
+  else
+    *en &= ~(1U << (irq % 32));
+}
+
+// number of sources routed to hart
+static int irq_sources(int hart) {
+  int n = 0;
+
+  for (int i=1; i<NIRQ; i++)
+    if (irqs[i].handler && irqs[i].hart == hart)
+      n++;
+  return n;
+}
+
+static void irq_move(int irq, int hart) {
+  if (irqs[irq].hart == hart)
+    return;
+  if (irqs[irq].hart >= 0)
+    plic_enable(irqs[irq].hart, irq, 0);
+  plic_enable(hart, irq, 1);
+  irqs[irq].hart = hart;
+}
+
+// route irq to the online hart of its affinity mask that serves the fewest
+// sources. Only irq_register at boot, before the other harts are up, can
+// find none of them online; then the first hart of the mask takes it and
+// hands it on in irq_online.
+static void irq_route(int irq) {
+  int best = -1;
+
+  for (int h=0; h<NCPU; h++) {
+    if (!(irqs[irq].affinity & (1ULL << h)) || !cpus[h].online)
+      continue;
+    if (best < 0 || irq_sources(h) < irq_sources(best) - (irqs[irq].hart == best))
+      best = h;
+  }
+  if (best < 0)
+    best = __builtin_ctzll(irqs[irq].affinity);
+  irq_move(irq, best);
+}
+
+// the calling hart takes device interrupts from now on
+void irq_hart_init(void) {
+  int h = mycpu()->hartid;
+
+  for (int i=0; i<NIRQ/32; i++)
+    ((volatile uint32*)PLIC_MENABLE(h))[i] = 0;
+
+  // set this hart's M-mode priority threshold to 0.
+  *(volatile uint32*)PLIC_MPRIORITY(h) = 0;
+
+  // enable machine-mode external interrupts.
+  w_mie(r_mie() | MIE_MEIE);
+}
+
+// a hart came online: take over sources from harts that serve more than we do
+void irq_online(void) {
+  int h = mycpu()->hartid;
+
+  // isolated harts only get the sources explicitly bound to them
+  if (mycpu()->isolated)
+    return;
+  for (int i=1; i<NIRQ; i++) {
+    if (irqs[i].handler && (irqs[i].affinity & (1ULL << h)) &&
+        irq_sources(irqs[i].hart) > irq_sources(h) + 1)
+      irq_move(i, h);
+  }
+}
+
+// install the handler for a source and route it to one of the harts in affinity
+void irq_register(int irq, void (*handler)(int), uint64 affinity) {
+  // set desired IRQ priorities non-zero (otherwise disabled).
+  *(volatile uint32*)(PLIC_PRIORITY + irq*4) = 1;
+  irqs[irq].handler = handler;
+  irqs[irq].affinity = affinity;
+  irqs[irq].hart = -1;
+  irq_route(irq);
+}
+
+// IRQAFFINITY syscall. Harts of the mask that are not online are dropped.
+// returns -1 for an unknown source or a mask without any online hart.
+int irq_set_affinity(uint64 irq, uint64 mask) {
+  uint64 online = 0;
+
+  for (int h=0; h<NCPU; h++)
+    if (cpus[h].online)
+      online |= 1ULL << h;
+  mask &= online;
+  if (irq == 0 || irq >= NIRQ || irqs[irq].handler == 0 || mask == 0)
+    return -1;
+  irqs[irq].affinity = mask;
+  if (!(mask & (1ULL << irqs[irq].hart)))
+    irq_route(irq);
+  return 0;
+}
+
+void external_interrupt(void) {
+  int irq = plic_claim();
+
+  // 0: the source was withdrawn from this hart after it raised the interrupt
+  if (irq == 0)
+    return;
+  irqs[irq].count++;
+  mycpu()->irqs_served++;
+  if (irqs[irq].handler)
+    irqs[irq].handler(irq);
+  plic_complete(irq);
+}
+
+// Spread the busy sources over the harts: every IRQ_BALANCE_INTERVAL, place
+// them busiest first, each on the online hart of its mask that got the
+// fewest interrupts of the sources placed so far. Only with -DIRQBALANCE;
+// otherwise sources stay where irq_register and irq_online put them.
+#ifdef IRQBALANCE
+static uint64 next_irq_balance;
+
+void irq_balance(uint64 now) {
+  uint64 delta[NIRQ], load[NCPU];
+  int done[NIRQ];
+
+  if (now < next_irq_balance)
+    return;
+  next_irq_balance = now + IRQ_BALANCE_INTERVAL;
+
+  for (int i=0; i<NIRQ; i++) {
+    delta[i] = irqs[i].count - irqs[i].lastcount;
+    irqs[i].lastcount = irqs[i].count;
+    done[i] = irqs[i].handler == 0 || delta[i] == 0;
+  }
+  for (int h=0; h<NCPU; h++)
+    load[h] = 0;
+
+  while (1) {
+    int irq = -1;
+    for (int i=1; i<NIRQ; i++)
+      if (!done[i] && (irq < 0 || delta[i] > delta[irq]))
+        irq = i;
+    if (irq < 0)
+      break;
+    done[irq] = 1;
+
+    // stay on the current hart unless another one is less loaded - or it
+    // is no longer one we may use, then the first one that is
+    uint64 mask = irqs[irq].affinity & ~ISOLHARTS;
+    int cur = irqs[irq].hart;
+    int best = (mask & (1ULL << cur)) && cpus[cur].online ? cur : -1;
+    for (int h=0; h<NCPU; h++) {
+      if ((mask & (1ULL << h)) && cpus[h].online && (best < 0 || load[h] < load[best]))
+        best = h;
+    }
+    if (best < 0)
+      continue;
+    load[best] += delta[irq];
+    if (best != irqs[irq].hart) {
+      irq_move(irq, best);
+      irqs[irq].moves++;
+    }
+  }
+}
+#else
+void irq_balance(uint64 now) {
+}
+#endif
+
+void irq_stats(void) {
+  for (int i=1; i<NIRQ; i++) {
+    if (!irqs[i].handler)
+      continue;
+    printastring("irq "); printhex(i);
+    printastring(" hart "); printhex(irqs[i].hart);
+    printastring(" affinity "); printhex(irqs[i].affinity);
+    printastring(" count "); printhex(irqs[i].count);
+    printastring(" moves "); printhex(irqs[i].moves);
+    printastring("\n");
+  }
+  for (int h=0; h<NCPU; h++) {
+    if (!cpus[h].online)
+      continue;
+    printastring("hart "); printhex(h);
+    printastring(" irqs served "); printhex(cpus[h].irqs_served);
+    printastring("\n");
+  }
+}
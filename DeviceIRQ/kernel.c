@@ -1,22 +1,33 @@
 #include "types.h"
 #include "riscv.h"
 #include "hardware.h"
+#include "spinlock.h"
 #include "kernel.h"
 #include "syscalls.h"
 
 extern int main(void);
 extern void ex(void);
 extern void printstring(char *s);
-extern uint64 pt[8][512*3];
 
-#define SATP_SV39 (8L << 60)
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
-
-__attribute__ ((aligned (16))) char stack0[4096];
-
-#define BUFFER_SIZE 32
-char ringbuffer[BUFFER_SIZE];
-int  head, tail, full_flag = 0, nelem = 0;
+__attribute__ ((aligned (16))) char stack0[NCPU][4096];
+
+// characters the UART received and nobody read yet, in a FIFO of chunks
+// from rxchunk_cache. It grows as long as there is memory; full_flag is
+// only set when there is none.
+#define RXCHUNK 48
+typedef struct rxchunk {
+  struct rxchunk *next;
+  int head, tail;    // next slot to write, next to read
+  char data[RXCHUNK];
+} rxchunk;
+
+kmem_cache rxchunk_cache = KMEM_CACHE_INIT("rxchunk", sizeof(rxchunk), 0);
+rxchunk *rxfirst, *rxlast; // read from the first, write to the last
+int  full_flag = 0, nelem = 0;
+ticketlock rb_lock __attribute__((aligned(CACHELINE))) = TICKETLOCK_INIT("ringbuffer");
+// keeps the statistics dumps, which run without the kernel lock, and the
+// output of PRINTASTRING from interleaving
+ticketlock console_lock __attribute__((aligned(CACHELINE))) = TICKETLOCK_INIT("console");
 
 void printhex(uint64);
 
@@ -25,26 +36,79 @@ volatile struct uart* uart0 = (volatile struct uart *)0x10000000;
 // Syscall 1: printstring. Takes a char *, prints the string to the UART, returns nothing
 // Syscall 2: putachar.    Takes a char, prints the character to the UART, returns nothing
 // Syscall 3: getachar.    Takes no parameter, reads a character from the UART (keyboard), returns the char
-// Syscall 4: sleep.       Takes a uint64, suspends the process for the given number of timer ticks
+// Syscall 4: sleep.       Takes a uint64, suspends the process until the given timer tick
+// Syscall 5: setslack.    Takes a uint64, sets the number of mtime cycles the process' wakeups may be deferred
+// Syscall 6: itimerset.   Takes an initial delay and a period (a1, 0 = one-shot) in mtime cycles, arms the interval timer
+//                         (a delay of 0 disarms it), returns 0 or -1 if there is no memory for the timer
+// Syscall 7: itimerread.  Takes no parameter, returns the number of expiries since the last read/wait
+// Syscall 8: itimerwait.  Takes no parameter, blocks until the timer expired at least once, returns the number of expiries
+// Syscall 9: groupcreate. Takes a parent group, a quota (a1) and a period (a2) in mtime cycles, returns the new group id
+//                         (quota 0 = unlimited; group 0 is the root group every process starts in)
+// Syscall 10: groupattach. Takes a group id, moves the calling process into that group
+// Syscall 11: groupusage.  Takes a group id, returns the mtime cycles used by the group and its children
+// Syscall 12: setsched.    Takes a policy number (0 = round robin, 1 = fair), returns the previous policy
+// Syscall 13: schedstats.  Takes no parameter, prints the per-hart scheduler counters
+// Syscall 14: lockstats.   Takes no parameter, prints the lock counters (all 0 unless built with -DLOCKSTAT)
+// Syscall 15: vmstats.     Takes no parameter, prints the memory management counters
+// Syscall 16: irqaffinity. Takes an interrupt source and a hart mask (a1), routes the source to one of these harts,
+//                         returns 0, or -1 for an unknown source or a mask without an online hart
+// Syscall 17: irqstats.    Takes no parameter, prints where each interrupt source is routed and how often it fired
+// Syscall 18: setaffinity. Takes a hart mask, restricts the calling process to these harts, returns 0,
+//                         or -1 if none of them is up
+// Syscall 19: getaffinity. Takes no parameter, returns the hart mask of the calling process
+// Syscall 20: setnode.     Takes a NUMA node (-1 = the node of the hart it runs on), allocates the calling
+//                         process' memory there from now on, returns 0 or -1 if there is no such node
+// Syscall 21: procinfo.    Takes a pid and a procinfo pointer (a1), copies the process' metadata there without
+//                         taking the kernel lock, returns 0 or -1 if there is no such process
+// Syscall 22: falseshare.  Takes a layout (0 = packed, 1 = one cache line per hart) and a count (a1), increments
+//                         this hart's benchmark counter count times, returns the mtime cycles it took
 // Syscall 23: yield.       Takes no parameter, gives up the CPU
+// Syscall 24: setthp.      Takes 0 or 1, forbids or allows backing the calling process' memory with 2 MB
+//                         megapages and 64 KB Svnapot blocks (forbidding splits the ones it has),
+//                         returns the previous setting
+// Syscall 25: fork.        Takes no parameter, creates a copy of the calling process that shares its
+//                         memory copy-on-write, returns the pid of the child, 0 in the child, -1 if
+//                         there is no free process slot or memory
+// Syscall 26: shmget.      Takes a name (pointer) and a size (a1), returns the id of the shared memory segment
+//                         of that name, created zeroed with size bytes (up to 2 MB) if there is none and
+//                         size is not 0, or -1
+// Syscall 27: shmmap.      Takes a segment id, an address (a1, 0 = the kernel picks one) and SHM_READ or
+//                         SHM_WRITE (a2), maps the segment there, returns the address or -1
+// Syscall 28: shmunmap.    Takes the address of a mapping of shared memory, removes it, returns 0 or -1
+// Syscall 29: shmremove.   Takes a segment id, removes its name and frees it with its last mapping,
+//                         returns 0 or -1
+// Syscall 30: brk.         Takes an address (0 = none), moves the end of the heap there, returns the end of
+//                         the heap or -1. Pages are allocated on first touch
+// Syscall 31: mmap.        Takes an address (0 = the kernel picks one), a length (a1) and PROT_READ or
+//                         PROT_WRITE (a2), reserves that much zero-filled memory, returns the address or -1.
+//                         Pages are allocated on first touch
+// Syscall 32: munmap.      Takes an address and a length (a1), gives back that range of MMAP memory,
+//                         returns 0 or -1
 // Syscall 42: exit.        Takes no parameter, exits the process
 
 
-uint64 ticks = 0;
+uint64 ticks __attribute__((aligned(CACHELINE))) = 0;
+extern schedgroup groups[NGROUPS];
+extern schedclass *sched;
 pcbentry pcb[MAXPROCS];
-uint64 current_pid;
-uint64 waiting_pid;
-int was_syscall = 0;
+cpu cpus[NCPU];
+waitqueue uart_rxq = WAITQUEUE_INIT; // processes blocked in getachar
+
+// one lock around the pcb table and the rest of the kernel state. Harts take
+// it on every trap and only drop it to return to user mode or to wait for an
+// interrupt when idle. It is the most contended lock, so it is an MCS lock.
+mcslock kernel_lock __attribute__((aligned(CACHELINE))) = MCSLOCK_INIT("kernel");
 
-uint64 virt2phys(uint64 addr) {
-  return pcb[current_pid].physbase + addr;
+// while we wait, the holder may be waiting for us to flush our TLB
+void acquire_kernel(void) {
+  mcs_acquire_poll(&kernel_lock, &mycpu()->kernel_node, tlb_poll);
 }
 
-uint64 phys2virt(uint64 addr) {
-  return addr - pcb[current_pid].physbase;
+void release_kernel(void) {
+  mcs_release(&kernel_lock);
 }
 
-static void putachar(char c) {
+void putachar(char c) {
   while ((uart0->LSR & (1<<5)) == 0)
     ; // polling!
   uart0->THR = c;
@@ -81,21 +145,6 @@ void printhex(uint64 x) {
   }
 }
 
-// ask the PLIC what interrupt we should serve.
-int
-plic_claim(void)
-{    
-  int irq = *(uint32*)PLIC_MCLAIM;
-  return irq;         
-}       
-
-// tell the PLIC we've served this IRQ.
-void    
-plic_complete(int irq)
-{       
-  *(uint32*)PLIC_MCLAIM = irq;
-}       
-
 int buffer_is_full(void) {
   return (full_flag == 1);
 }
@@ -105,38 +154,54 @@ int buffer_is_empty(void) {
 }
 
 int rb_write(char c) {
-  int retval;
+  int retval = 0;
 
-  // wait(&mutex);
-  if (buffer_is_full()) {
-     retval = -1;
-  } else {
-    ringbuffer[head] = c;
-    head = (head+1) % BUFFER_SIZE;
-    nelem++;
-    if (head == tail)
+  ticket_acquire(&rb_lock);
+  if (rxlast == 0 || rxlast->head == RXCHUNK) {
+    rxchunk *k = kmem_alloc(&rxchunk_cache);
+    if (k == 0) {
       full_flag = 1;
-    retval = 0;
+      retval = -1;
+    } else {
+      k->next = 0;
+      k->head = k->tail = 0;
+      if (rxlast)
+        rxlast->next = k;
+      else
+        rxfirst = k;
+      rxlast = k;
+    }
+  }
+  if (retval == 0) {
+    rxlast->data[rxlast->head++] = c;
+    nelem++;
   }
-  //signal(&mutex);
-  
+  ticket_release(&rb_lock);
+
   return retval;
 }
 
 int rb_read(char *c) {
   int retval;
 
-//  wait(&mutex);
+  ticket_acquire(&rb_lock);
   if (buffer_is_empty()) {
     retval = -1;
   } else {
-    *c = ringbuffer[tail];
-    tail = (tail+1) % BUFFER_SIZE;
+    *c = rxfirst->data[rxfirst->tail++];
     nelem--;
     full_flag = 0;
     retval = 0;
+    // a chunk that was read to its end is not written to any more
+    if (rxfirst->tail == RXCHUNK) {
+      rxchunk *k = rxfirst;
+      rxfirst = k->next;
+      if (rxfirst == 0)
+        rxlast = 0;
+      kmem_free(&rxchunk_cache, k);
+    }
   }
-//  signal(&mutex);
+  ticket_release(&rb_lock);
   return retval;
 }
 
@@ -154,50 +219,470 @@ unsigned char readachar(void) {
     }
 }
 
+// make a process runnable (again) after it was created, blocked or asleep
+// If it is queued on another hart, that hart is interrupted right away
+// instead of finding it at its next timer interrupt.
+void sched_wakeup(int pid) {
+  int hart = sched_select_hart(pid);
+
+  pcb[pid].hart = hart;
+  pcb[pid].state = READY;
+  if (sched->wakeup)
+    sched->wakeup(pid);
+  sched_enqueue(pid);
+  if (hart != mycpu()->hartid)
+    ipi_send(hart, IPI_RESCHED);
+}
+
+kmem_cache waiter_cache = KMEM_CACHE_INIT("waiter", sizeof(waiter), 0);
+
+// block process pid on wq. The caller has to schedule() afterwards.
+// returns 0, or -1 if there is no memory for the entry; then pid stays
+// runnable.
+int wq_wait(waitqueue *wq, int pid) {
+  waiter *w = kmem_alloc(&waiter_cache);
+
+  if (w == 0)
+    return -1;
+  w->pid = pid;
+  w->next = 0;
+  if (wq->tail == 0)
+    wq->head = w;
+  else
+    wq->tail->next = w;
+  wq->tail = w;
+  pcb[pid].state = BLOCKED;
+  return 0;
+}
+
+// make the longest waiting process on wq runnable.
+// returns 1 if a process was woken, 0 if nobody was waiting.
+int wq_wake_one(waitqueue *wq) {
+  waiter *w = wq->head;
+  int pid;
+
+  if (w == 0)
+    return 0;
+  wq->head = w->next;
+  if (wq->head == 0)
+    wq->tail = 0;
+  pid = w->pid;
+  kmem_free(&waiter_cache, w);
+  sched_wakeup(pid);
+  return 1;
+}
+
+// make every process waiting on wq runnable. returns the number woken.
+int wq_wake_all(waitqueue *wq) {
+  int woken = 0;
+
+  while (wq_wake_one(wq))
+    woken++;
+  return woken;
+}
+
+// ---- process info, readable without the kernel lock ----
+
+kmem_cache procinfo_cache = KMEM_CACHE_INIT("procinfo", sizeof(procinfo), 0);
+
+static void info_free(void *p) {
+  kmem_free(&procinfo_cache, p);
+}
+
+// publish the current metadata of pid for lockless readers - or retract it
+// if the process is gone. The old version is freed once nobody reads it.
+// Called with the kernel lock held, after every change of the fields.
+void proc_publish(int pid) {
+  procinfo *old = pcb[pid].info;
+  procinfo *new = 0;
+
+  if (pcb[pid].state != NONE) {
+    new = kmem_alloc(&procinfo_cache);
+    if (new == 0)
+      return; // readers keep seeing the old version
+    new->pid = pid;
+    new->group = pcb[pid].group;
+    new->affinity = pcb[pid].affinity;
+    new->node = pcb[pid].node;
+    new->started = old ? old->started : r_mtime();
+    new->version = old ? old->version + 1 : 0;
+  }
+  __atomic_store_n(&pcb[pid].info, new, __ATOMIC_RELEASE);
+  if (old)
+    rcu_call(info_free, old);
+}
+
+// PROCINFO syscall, served without the kernel lock: copy the metadata of
+// pid to out. returns 0, or -1 if there is no such process.
+int proc_info(uint64 pid, procinfo *out) {
+  int retval = -1;
+
+  if (pid >= MAXPROCS)
+    return -1;
+  rcu_read_lock();
+  procinfo *p = __atomic_load_n(&pcb[pid].info, __ATOMIC_ACQUIRE);
+  if (p) {
+    *out = *p;
+    retval = 0;
+  }
+  rcu_read_unlock();
+  return retval;
+}
+
+// ---- false sharing benchmark ----
+
+uint64 fs_packed[NCPU] __attribute__((aligned(CACHELINE))); // all in one cache line
+struct {
+  uint64 v __attribute__((aligned(CACHELINE)));
+} fs_padded[NCPU];                                          // one line each
+
+// FALSESHARE syscall, run without the kernel lock so that all harts can run
+// it at once: increment this hart's counter iters times. returns the mtime
+// cycles it took.
+uint64 false_share(uint64 padded, uint64 iters) {
+  uint64 *c = padded ? &fs_padded[mycpu()->hartid].v : &fs_packed[mycpu()->hartid];
+  uint64 start = r_mtime();
+
+  for (uint64 i=0; i<iters; i++)
+    __atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+  return r_mtime() - start;
+}
+
+// wake every sleeper whose slack window [wakeuptime, wakeuptime + slack] has
+// already opened, so all of them are served by the same interrupt.
+// returns the number of them queued on this hart; the other harts are told
+// by sched_wakeup.
+int timer_expire(uint64 now) {
+  int woken = 0;
+
+  ticks = now / TICK_INTERVAL;
+  for (int i=0; i<MAXPROCS; i++) {
+    if (pcb[i].state == SLEEPING && now >= pcb[i].wakeuptime) {
+      pcb[i].wakeuptime = 0;
+      sched_wakeup(i);
+      if (pcb[i].hart == mycpu()->hartid)
+        woken++;
+    }
+  }
+  return woken;
+}
+
+// program hart's CLINT timer for its earliest hard deadline, i.e. the end of
+// its current slice and, on hart 0, the end of a throttled group's period or
+// the latest point a sleeper's slack allows it to be woken.
+// Sleepers whose windows overlap that point are woken together by timer_expire.
+static void timer_program_hart(int hart) {
+  uint64 next = cpus[hart].slice_end;
+
+  // hart 0 keeps the time for everybody, so the other harts do not all take
+  // an interrupt for the same sleeper. It sends the processes it wakes to
+  // other harts by IPI.
+  if (hart == 0) {
+    // throttled groups may run again at the start of their next period
+    for (int g=0; g<NGROUPS; g++) {
+      if (groups[g].used && groups[g].throttled && groups[g].period_start + groups[g].period < next)
+        next = groups[g].period_start + groups[g].period;
+    }
+
+    for (int i=0; i<MAXPROCS; i++) {
+      if (pcb[i].state == SLEEPING) {
+        uint64 deadline = pcb[i].wakeuptime + pcb[i].slack;
+        if (deadline < pcb[i].wakeuptime) // slack overflowed
+          deadline = ~0ULL;
+        if (deadline < next)
+          next = deadline;
+      }
+    }
+  }
+  *(uint64*)CLINT_MTIMECMP(hart) = next;
+}
+
+// program this hart's timer and, as a process may just have gone to sleep
+// here, hart 0's timekeeping deadline
+void timer_program(void) {
+  timer_program_hart(mycpu()->hartid);
+  if (mycpu()->hartid != 0)
+    timer_program_hart(0);
+}
+
+// arm (or with delay 0 disarm) an interval timer. Expiries are placed at
+// fixed multiples of the period from the first one, so they do not drift.
+void itimer_set(itimer *t, uint64 delay, uint64 period) {
+  t->overrun = 0;
+  t->period = period;
+  t->next = (delay == 0) ? 0 : r_mtime() + delay;
+}
+
+// fold every expiry up to now into the overrun counter. Nobody is interrupted
+// for expiries of a timer whose owner is not waiting on it; they are counted
+// here, when the owner reads or waits.
+void itimer_update(itimer *t, uint64 now) {
+  if (t->next == 0 || now < t->next)
+    return;
+  if (t->period == 0) {
+    t->overrun++;
+    t->next = 0;
+  } else {
+    uint64 n = (now - t->next) / t->period + 1;
+    t->overrun += n;
+    t->next += n * t->period;
+  }
+}
+
+kmem_cache itimer_cache = KMEM_CACHE_INIT("itimer", sizeof(itimer), 0);
+
+// ITIMERSET syscall: arm pid's interval timer, which it gets on first use.
+// returns 0, or -1 if there is no memory for it.
+int itimer_arm(int pid, uint64 delay, uint64 period) {
+  if (pcb[pid].timer == 0) {
+    if (delay == 0)
+      return 0;
+    if ((pcb[pid].timer = kmem_alloc(&itimer_cache)) == 0)
+      return -1;
+  }
+  itimer_set(pcb[pid].timer, delay, period);
+  return 0;
+}
+
+// ITIMERREAD syscall: the expiries of pid's timer since the last call
+uint64 itimer_collect(int pid) {
+  itimer *t = pcb[pid].timer;
+  uint64 n;
+
+  if (t == 0)
+    return 0;
+  itimer_update(t, r_mtime());
+  n = t->overrun;
+  t->overrun = 0;
+  return n;
+}
+
+void uart_interrupt(int irq) {
+  char c = uart0->RBR;
+  // one buffered character can satisfy one reader
+  if (rb_write(c) == 0)
+    wq_wake_one(&uart_rxq);
+  if (full_flag) putachar('*');
+}
+
+// nothing is runnable: wait for the next sleeper deadline or device interrupt.
+// We are inside the trap handler with interrupts masked, but wfi still returns
+// once an interrupt enabled in mie is pending, so we poll mip and handle it here.
+// Other harts may run the kernel meanwhile, so we drop the kernel lock.
+static void idle(void) {
+  mycpu()->slice_end = ~0ULL;
+  timer_program();
+  release_kernel();
+  frame_zero_idle();
+  asm volatile("wfi");
+  // an IPI_RESCHED just makes us look for work again
+  if (r_mip() & MIP_MSIP)
+    ipi_receive();
+  acquire_kernel();
+
+  uint64 mip = r_mip();
+  if (mip & MIP_MTIP) {
+    mycpu()->timer_irqs++;
+    timer_expire(r_mtime());
+  }
+  if (mip & MIP_MEIP)
+    external_interrupt();
+}
+
 void schedule() {
-  while (1) {
-    current_pid = (current_pid + 1) % MAXPROCS;
-#ifdef DEBUG
-    printastring("> Trying "); printhex(current_pid); printastring(": "); printhex(pcb[current_pid].state); printastring("\n");
-#endif
-    if (pcb[current_pid].state == READY) {
-      pcb[current_pid].state = RUNNING;
-    break;
+  int pid;
+
+  // a preempted or yielding process goes back to this hart's run queue
+  if (mycpu()->pid >= 0) {
+    pcb[mycpu()->pid].lastran = r_mtime();
+    if (pcb[mycpu()->pid].state == RUNNING) {
+      pcb[mycpu()->pid].state = READY;
+      // unless SETAFFINITY took this hart away from it
+      if (!(pcb[mycpu()->pid].affinity & (1ULL << mycpu()->hartid))) {
+        pcb[mycpu()->pid].hart = sched_select_hart(mycpu()->pid);
+        ipi_send(pcb[mycpu()->pid].hart, IPI_RESCHED);
+      }
+      sched_enqueue(mycpu()->pid);
     }
   }
-  w_mscratch(pcb[current_pid].physbase);
+  mycpu()->pid = -1;
+
+  // a context switch: free what the readers are done with
+  rcu_poll();
+
+  while (1) {
+    group_refresh(r_mtime());
+    pid = sched_pick();
+    if (pid >= 0)
+      break;
+    if (sched_steal() >= 0)
+      continue;
+    idle();
+  }
+  mycpu()->pid = pid;
+  mycpu()->rq.switches++;
+
+  // give the new process a fresh slice and rearm the timer for it
+  mycpu()->dispatch_time = r_mtime();
+  if (sched_tickless())
+    mycpu()->slice_end = ~0ULL;
+  else
+    mycpu()->slice_end = mycpu()->dispatch_time + SLICE_TICKS * TICK_INTERVAL;
+  timer_program();
 
   // set new process to RUNNING
-  pcb[current_pid].state = RUNNING;
+  pcb[mycpu()->pid].state = RUNNING;
 #ifdef DEBUG
-  printastring("> Switch to "); printhex(current_pid); printastring("\n");
+  printastring("> Switch to "); printhex(mycpu()->pid); printastring("\n");
 #endif
 }
 
+// switch to the address space of the process this hart runs next, and make
+// its trap frame the one ex.S restores and saves into on the next trap.
+// The address space is tagged with ASID pid+1, so there is no TLB flush here
+// unless the hart has too few ASID bits for that; changes to a page table are
+// flushed with tlb_invalidate/tlb_flush instead.
+riscv_regs *return_to_user(void) {
+  w_satp(pcb[mycpu()->pid].satp);
+  if (mycpu()->asid_flush)
+    asm volatile("sfence.vma zero, zero");
+  pcb[mycpu()->pid].tlb_harts |= 1ULL << mycpu()->hartid;
+
+  // pc already points after the ecall if its syscall completed.
+  w_mepc(pcb[mycpu()->pid].pc);
+
+  mycpu()->tf = &pcb[mycpu()->pid].regs;
+  return mycpu()->tf;
+}
+
+// FORK syscall: a new process that continues after the ecall like the one
+// running on this hart, with a copy-on-write copy of its memory. returns
+// the child's pid, or -1 if there is no free slot or memory.
+int proc_fork(void) {
+  int parent = mycpu()->pid;
+  int child;
+
+  for (child=0; child<MAXPROCS && pcb[child].state != NONE; child++)
+    ;
+  if (child == MAXPROCS)
+    return -1;
+
+  pcb[child].hart = pcb[parent].hart;
+  pcb[child].node = pcb[parent].node;
+  pcb[child].affinity = pcb[parent].affinity;
+  pcb[child].group = pcb[parent].group;
+  pcb[child].slack = pcb[parent].slack;
+  pcb[child].vruntime = pcb[parent].vruntime;
+  pcb[child].wakeuptime = 0;
+  pcb[child].timer = 0;
+  pcb[child].tlb_harts = 0;
+  pcb[child].tlb_batch.n = 0;
+  if (uvm_fork(parent, child) < 0)
+    return -1;
+
+  // the parent's pc already points after the ecall
+  pcb[child].pc = pcb[parent].pc;
+  pcb[child].regs = pcb[parent].regs;
+  pcb[child].regs.a0 = 0;
+  sched_wakeup(child);
+  proc_publish(child);
+  return child;
+}
+
+// the process running on this hart is done: release everything it has and
+// run something else
+void proc_exit(void) {
+  int pid = mycpu()->pid;
+
+  pcb[pid].state = NONE;
+  proc_publish(pid);
+  uvm_free(pid);
+  if (pcb[pid].timer) {
+    kmem_free(&itimer_cache, pcb[pid].timer);
+    pcb[pid].timer = 0;
+  }
+  schedule();
+}
+
 // This is the C code part of the exception handler
-// "exception" is called from the assembler function "ex" in ex.S with registers saved on the stack
+// "exception" is called from the assembler function "ex" in ex.S with the
+// registers saved in the trap frame of the process running on this hart
 uint64 exception(riscv_regs *regs) {
   uint64 nr;
   uint64 param;
   uint64 retval = 0;
+  int was_syscall = 1;
+  uint32 ipis = 0;
+
+  uint64 pc = r_mepc();
+  uint64 mcause = r_mcause();
+  uint64 mtval = r_mtval();
 
-  was_syscall = 1;
+  // requests from other harts that only touch this hart are served before
+  // we queue up for the kernel lock, whose holder may be waiting for them
+  if (mcause == ((1ULL<<63) | MSI))
+    ipis = ipi_receive();
+
+  // lookups that read RCU protected data need no lock at all. Only this hart
+  // touches the pc of the process running here.
+  // A PROCINFO buffer the process did not touch yet or shares copy-on-write
+  // needs the page fault path, which may have to shoot down TLBs; it takes
+  // the slow path below.
+  if (mcause == 8 && regs->a7 == PROCINFO &&
+      user_writable(mycpu()->pid, regs->a1) && user_writable(mycpu()->pid, regs->a1 + sizeof(procinfo) - 1)) {
+    procinfo info;
+    retval = proc_info(regs->a0, &info);
+    if (retval == 0 && copyout(mycpu()->pid, regs->a1, &info, sizeof(info)) < 0)
+      retval = -1;
+    regs->a0 = retval;
+    pcb[mycpu()->pid].pc = pc + 4;
+    w_mepc(pc + 4);
+    return (uint64)regs;
+  }
+  // so are the statistics: counters are read as they are, lists that can
+  // shrink - vmas, shared memory segments - are RCU protected. The hart
+  // printing may be waiting for the kernel lock's holder, which may be
+  // waiting for our TLB flush, so we serve TLB requests while we wait.
+  if (mcause == 8 && (regs->a7 == SCHEDSTATS || regs->a7 == VMSTATS)) {
+    ticket_acquire_poll(&console_lock, tlb_poll);
+    rcu_read_lock();
+    if (regs->a7 == SCHEDSTATS) {
+      sched_stats();
+    } else {
+      frame_stats();
+      vm_stats();
+      tlb_stats();
+      rcu_stats();
+      kmem_stats();
+      shm_stats();
+    }
+    rcu_read_unlock();
+    ticket_release(&console_lock);
+    regs->a0 = 0;
+    pcb[mycpu()->pid].pc = pc + 4;
+    w_mepc(pc + 4);
+    return (uint64)regs;
+  }
+  if (mcause == 8 && regs->a7 == FALSESHARE) {
+    regs->a0 = false_share(regs->a0, regs->a1);
+    pcb[mycpu()->pid].pc = pc + 4;
+    w_mepc(pc + 4);
+    return (uint64)regs;
+  }
+
+  acquire_kernel();
 
   nr = regs->a7;
   param = regs->a0;
 
-  uint64 pc = r_mepc();
-  uint64 mcause = r_mcause();
-  uint64 mtval = r_mtval();
+  group_charge(r_mtime());
 
-  pcb[current_pid].pc = pc;
-  pcb[current_pid].sp = phys2virt((uint64)regs);
-  pcb[current_pid].state = READY; // or blocked in the future...
+  pcb[mycpu()->pid].pc = pc;
 
 // #define DEBUG
 #ifdef DEBUG
       printastring("EXC pid = ");
-      printhex(current_pid);
+      printhex(mycpu()->pid);
       printastring(", mcause = ");
       printhex(mcause);
       printastring(", mepc = ");
@@ -211,32 +696,23 @@ uint64 exception(riscv_regs *regs) {
     // Interrupt - async
     was_syscall = 0;
     if ((mcause & ~(1ull<<63)) == MTI) { // timer interrupt / CLINT
-      int interval = 2000; // cycles; about 1/10th second in qemu.
-      *(uint64*)CLINT_MTIMECMP(0) = *(uint64*)CLINT_MTIME + interval;
-
-      ticks++;
-
-      if ((ticks % 10) == 0) {
-        // anyone asleep?
-        for (int i=0; i<MAXPROCS; i++) {
-          if (pcb[i].state == SLEEPING) {
-            if (ticks >= pcb[i].wakeuptime) {
-              pcb[i].state = READY;
-              pcb[i].wakeuptime = 0;
-            }
-          }
-        }
+      // the CLINT is programmed for the next deadline only, not every tick,
+      // so one interrupt serves all sleepers whose slack windows overlap.
+      uint64 now = r_mtime();
+
+      mycpu()->timer_irqs++;
+      group_refresh(now);
+      sched_balance(now);
+      irq_balance(now);
+      if (timer_expire(now) > 0 || sched->tick(now) || group_throttled(pcb[mycpu()->pid].group))
         schedule();
-      }
+      else
+        timer_program();
     } else if ((mcause & ~(1ull<<63)) == MEI) { // external interrupt / PLIC
-      int irq = plic_claim();
-      if (irq == UART0_IRQ) {
-	char c = uart0->RBR;
-        rb_write(c); 
-        if (full_flag) putachar('*');
-      }
-      plic_complete(irq);
-      pcb[waiting_pid].state = READY; // make blocked process runnable again...
+      external_interrupt();
+    } else if ((mcause & ~(1ull<<63)) == MSI) { // IPI from another hart / CLINT
+      if (ipis & IPI_RESCHED)
+        schedule();
     }
   } else {
     // all exceptions end up here
@@ -252,16 +728,96 @@ uint64 exception(riscv_regs *regs) {
 
       was_syscall = 1;
 
+      // resume after the ecall, unless the call blocks and has to be retried
+      pcb[mycpu()->pid].pc = pc + 4;
+
       switch(nr) {
       case SLEEP:
         if (param > 0) {
-          pcb[current_pid].state = SLEEPING;
-          pcb[current_pid].wakeuptime = param;
+          pcb[mycpu()->pid].state = SLEEPING;
+          pcb[mycpu()->pid].wakeuptime = param * TICK_INTERVAL;
         }
         schedule();
         break;
+      case SETSLACK:
+        pcb[mycpu()->pid].slack = param;
+        break;
+      case ITIMERSET:
+        retval = itimer_arm(mycpu()->pid, param, regs->a1);
+        break;
+      case ITIMERREAD:
+        retval = itimer_collect(mycpu()->pid);
+        break;
+      case ITIMERWAIT:
+        retval = itimer_collect(mycpu()->pid);
+        if (retval == 0 && pcb[mycpu()->pid].timer && pcb[mycpu()->pid].timer->next != 0) {
+          // sleep until the next expiry, then retry the ecall to collect it
+          was_syscall = 0;
+          pcb[mycpu()->pid].state = SLEEPING;
+          pcb[mycpu()->pid].wakeuptime = pcb[mycpu()->pid].timer->next;
+          pcb[mycpu()->pid].pc = pc;
+          schedule();
+        }
+        break;
+      case GROUPCREATE:
+        retval = group_create(param, regs->a1, regs->a2);
+        break;
+      case GROUPATTACH:
+        if (param >= NGROUPS || !groups[param].used) {
+          retval = -1;
+          break;
+        }
+        pcb[mycpu()->pid].group = param;
+        retval = 0;
+        // the new group may already be throttled
+        proc_publish(mycpu()->pid);
+        if (group_throttled(param))
+          schedule();
+        break;
+      case GROUPUSAGE:
+        retval = (param < NGROUPS && groups[param].used) ? groups[param].usage : -1;
+        break;
+      case SETSCHED:
+        retval = sched_switch(param);
+        break;
+      case LOCKSTATS:
+        lockstat_print(kernel_lock.name, &kernel_lock.stat);
+        lockstat_print(rb_lock.name, &rb_lock.stat);
+        lockstat_print(console_lock.name, &console_lock.stat);
+        break;
+      case IRQAFFINITY:
+        retval = irq_set_affinity(param, regs->a1);
+        break;
+      case IRQSTATS:
+        irq_stats();
+        break;
+      case SETAFFINITY:
+        retval = sched_set_affinity(mycpu()->pid, param);
+        proc_publish(mycpu()->pid);
+        if (retval == 0 && !(param & (1ULL << mycpu()->hartid)))
+          schedule();
+        break;
+      case GETAFFINITY:
+        retval = pcb[mycpu()->pid].affinity;
+        break;
+      case PROCINFO: {
+        procinfo info;
+        retval = proc_info(param, &info);
+        if (retval == 0 && copyout(mycpu()->pid, regs->a1, &info, sizeof(info)) < 0)
+          retval = -1;
+        break;
+      }
+      case SETTHP:
+        retval = vm_set_thp(mycpu()->pid, param != 0);
+        break;
+      case SETNODE:
+        retval = frame_set_node(mycpu()->pid, (int)param);
+        proc_publish(mycpu()->pid);
+        break;
       case PRINTASTRING:
-        printastring((char *)virt2phys(param));
+        ticket_acquire(&console_lock);
+        print_user_string(mycpu()->pid, param);
+        ticket_release(&console_lock);
         break;
       case PUTACHAR:
         putachar((char)param);
@@ -271,30 +827,73 @@ uint64 exception(riscv_regs *regs) {
         if (retval == 0) {
           was_syscall = 0;
 #ifdef DEBUG
-          printastring("BLOCK "); printhex(current_pid); printastring("\n");
+          printastring("BLOCK "); printhex(mycpu()->pid); printastring("\n");
 #endif
-          pcb[current_pid].state = BLOCKED;
-          waiting_pid = current_pid;
+          // without memory to block the process stays runnable and retries
+          // after the others had a turn
+          wq_wait(&uart_rxq, mycpu()->pid);
+          pcb[mycpu()->pid].pc = pc;
           schedule();
         } else {
           was_syscall = 1;
         }
         break;
+      case FORK:
+        retval = proc_fork();
+        break;
+      case SHMGET:
+        retval = shm_get(mycpu()->pid, param, regs->a1);
+        break;
+      case SHMMAP:
+        retval = shm_map(mycpu()->pid, (int)param, regs->a1, regs->a2);
+        break;
+      case SHMUNMAP:
+        retval = shm_unmap(mycpu()->pid, param);
+        break;
+      case SHMREMOVE:
+        retval = shm_remove((int)param);
+        break;
+      case BRK:
+        retval = vm_brk(mycpu()->pid, param);
+        break;
+      case MMAP:
+        retval = vm_mmap(mycpu()->pid, param, regs->a1, regs->a2);
+        break;
+      case MUNMAP:
+        retval = vm_munmap(mycpu()->pid, param, regs->a1);
+        break;
       case EXIT:
-        pcb[current_pid].state = NONE;
-        schedule(); 
+        proc_exit();
         break;
       case YIELD:
-        pcb[current_pid].state = READY;
         schedule();
         break;
       default:
         printastring("*** INVALID SYSCALL NUMBER!!! ***\n");
         break;
       }
+
+      // the caller's registers are still at regs, even if we switched away
+      if (was_syscall)
+        regs->a0 = retval;
+    } else if (mcause == 12 || mcause == 13 || mcause == 15) {
+      // page fault: map the page on first touch and retry the instruction,
+      // or kill the process if it has no business there
+      if (vm_fault(mycpu()->pid, mtval, mcause) < 0) {
+        printastring("page fault pid = ");
+        printhex(mycpu()->pid);
+        printastring(", mcause = ");
+        printhex(mcause);
+        printastring(", mepc = ");
+        printhex(pc);
+        printastring(", mtval = ");
+        printhex(mtval);
+        printastring(", killed\n");
+        proc_exit();
+      }
     } else { 
       printastring("EXC pid = ");
-      printhex(current_pid);
+      printhex(mycpu()->pid);
       printastring(", mcause = ");
       printhex(mcause);
       printastring(", mepc = ");
@@ -305,36 +904,14 @@ uint64 exception(riscv_regs *regs) {
     }
   }
 
-  // Here, we adjust return value - we want to return to the instruction _after_ the ecall! (at address mepc+4)
-
-#define SATP_SV39 (8L << 60)
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
-  w_satp(MAKE_SATP(pcb[current_pid].pagetablebase));
-  __asm__ volatile("sfence.vma zero, zero");
-
-  // printastring("\n->Process "); printhex(current_pid); printastring(" pagetable @ "); printhex((uint64)pcb[current_pid].pagetablebase); printastring("\n");
-  w_mscratch(pcb[current_pid].physbase);
-
-  // restore values for process we are going to switch to
-  // adjust return value - we want to return to the instruction _after_ the ecall! (at address mepc+4)
-  if (was_syscall) {
-    w_mepc(pcb[current_pid].pc + 4);
-    regs->a0 = retval; // return value of syscall
-  } else {
-    w_mepc(pcb[current_pid].pc);
-  }
-
-  regs = (riscv_regs*)virt2phys(pcb[current_pid].sp);
+  regs = return_to_user();
 
 #ifdef DEBUG
-  printastring("\nreturn sp = (V)"); printhex((uint64)pcb[current_pid].sp); printastring(" (P)"); printhex((uint64)regs);
-  printastring("\nreturn pc "); printhex((uint64)r_mepc()); printastring("\n");
+  printastring("\nreturn to "); printhex(mycpu()->pid); printastring(" pc "); printhex((uint64)r_mepc()); printastring("\n");
 #endif
 
-  // pass the return value back in a0
-  regs->a0 = retval;
-  regs->sp = (uint64)regs;
+  release_kernel();
 
-  // this function returns the new SP to ex.S
+  // this function returns the trap frame to restore to ex.S
   return (uint64)regs;
 }
@@ -1,13 +1,439 @@
 #define MAXPROCS 8
+#define NCPU 8 // harts we keep state for, also checked in boot.S
+#define CACHELINE 64
+#define ALLHARTS ((1ULL << NCPU) - 1)
+
+// harts that only run processes pinned to them with SETAFFINITY, e.g.
+// -DISOLCPUS=0x8. Hart 0 keeps the time for everybody and cannot be isolated.
+#ifndef ISOLCPUS
+#define ISOLCPUS 0
+#endif
+#define ISOLHARTS (ISOLCPUS & ALLHARTS & ~1ULL)
+
+#define NRCUCB 16 // RCU callbacks per block of a hart's batch
+#define TLB_BATCH 16 // pages invalidated one by one, more flush the address space
+
+#define TICK_HZ 5000 // ticks per second
+#define TICK_INTERVAL tick_interval // mtime cycles per tick, timebase / TICK_HZ; 2000 in qemu
+extern uint64 tick_interval;
+#define SLICE_TICKS 10     // ticks a process may run before it is preempted
+#define NGROUPS 8
+
+#define LOAD_SHIFT 10                    // run queue load averages are fixed point
+#define LOAD_ONE (1 << LOAD_SHIFT)       // load of one runnable process
+#define MIGRATION_COST (2 * TICK_INTERVAL) // a process that ran this recently is cache hot
+#define REBALANCE_INTERVAL (4 * SLICE_TICKS * TICK_INTERVAL)
+
+#define NIRQ 64 // PLIC interrupt sources we can route
+#define IRQ_BALANCE_INTERVAL (8 * SLICE_TICKS * TICK_INTERVAL)
 
 typedef enum { NONE, READY, RUNNING, BLOCKED, SLEEPING } procstate_t;
 
 typedef struct {
+  uint64 next;    // mtime of the next expiry, 0 if disarmed
+  uint64 period;  // mtime cycles between expiries, 0 for a one-shot timer
+  uint64 overrun; // expiries not yet collected by itimerread/itimerwait
+} itimer;
+
+// scheduling group with a CPU bandwidth quota. Groups nest; a process can
+// only run if none of the groups above it is throttled.
+typedef struct {
+  int used;
+  int parent;          // -1 for the root group
+  uint64 quota;        // mtime cycles the group may run per period, 0 = unlimited
+  uint64 period;       // mtime cycles
+  uint64 period_start;
+  uint64 runtime;      // cycles used in the current period
+  uint64 usage;        // cycles used since the group was created
+  int throttled;       // quota used up, wait for the next period
+  int cursor;          // member that ran last, for round robin among members
+} schedgroup;
+
+// scheduler policy. READY processes are handed to enqueue, which puts them
+// on the run queue of their hart, pick_next chooses the one to run next from
+// this hart's queue and dequeue takes it off again; all three are called
+// with that run queue's lock held, see sched_enqueue/sched_pick. tick is
+// asked on every timer interrupt whether the running process should be
+// preempted, and wakeup, if the policy has one, sees a process that becomes
+// runnable after blocking or sleeping.
+typedef struct {
+  char *name;
+  void (*enqueue)(int pid);
+  void (*dequeue)(int pid);
+  int  (*pick_next)(void);
+  int  (*tick)(uint64 now);
+  void (*wakeup)(int pid);
+} schedclass;
+
+int group_throttled(int g);
+void group_charge(uint64 now);
+void group_refresh(uint64 now);
+int group_create(int parent, uint64 quota, uint64 period);
+void sched_init(void);
+void sched_enqueue(int pid);
+int sched_pick(void);
+int sched_switch(uint64 nr);
+int sched_select_hart(int pid);
+int sched_set_affinity(int pid, uint64 mask);
+int sched_tickless(void);
+int sched_steal(void);
+void sched_balance(uint64 now);
+void sched_stats(void);
+
+#define NMEMRANGE 8 // memory nodes we keep from the device tree
+#define NNODE 4     // NUMA nodes, higher node ids are folded into node 0
+#define MAXORDER 18 // largest buddy block: 2^18 pages = 1 GB
+#define HUGEORDER 9 // buddy order of a 2 MB megapage
+#define NAPOTORDER 4 // buddy order of a 64 KB Svnapot block
+#define MAGSIZE 16  // objects in a per-hart magazine of an object cache
+#define SLAB_MAXORDER 3 // a slab is a block of up to 2^3 pages
+#define PCACHE 32   // pages in a hart's page cache
+#define ZPOOL_LOW 64   // idle harts refill a node's pool of zeroed pages below this
+#define ZPOOL_HIGH 256 // up to this
+#define UPROG_MAGIC 0x55505247 // start of the program header, see userentry.S
+#define USTACK_TOP 0x40000000  // user stacks grow down from here
+#define USTACK_SIZE (256 * PGSIZE)
+#define SHMNAME 16             // bytes of a segment name, with the NUL
+#define MMAP_BASE 0x20000000   // where the kernel places mappings nobody picked an address for
+
+// what the device tree told us about the machine, see fdt.c
+typedef struct {
+  uint64 fdt, fdt_size;     // where the blob is, so nobody overwrites it
+  uint64 ram_base, ram_size; // the memory range the kernel runs in
+  struct {
+    uint64 base, size;
+    uint32 node;            // NUMA node
+  } mem[NMEMRANGE];
+  int nmem;
+  int nharts;               // harts at or above this id stay parked
+  uint32 hartnode[NCPU];    // NUMA node of each hart
+  uint64 timebase;          // mtime cycles per second
+  uint64 clint, plic;
+  uint64 uart;
+  int uart_irq;
+  int svnapot;              // every hart has Svnapot (64 KB PTEs)
+} bootinfo;
+
+extern bootinfo boot;
+int fdt_parse(uint64 dtb);
+
+// per physical page, see frame.c
+typedef struct {
+  uint32 refs;     // references to an allocated page
+  uint8_t order;   // order of the block the page heads
+  uint8_t free;    // the page heads a free block
+} pageinfo;
+
+// pages of the hart's node kept for frame_alloc
+typedef struct {
+  int n;
+  uint64 pages[PCACHE];
+  uint64 refills;
+} pagecache;
+
+void frame_init(void);
+void frame_add(uint64 start, uint64 stop);
+uint64 page_alloc(int order, int node);
+void page_free(uint64 pa);
+void page_split(uint64 pa);
+pageinfo *page_info(uint64 pa);
+uint64 frame_alloc(int node);
+void frame_free(uint64 pa);
+void frame_ref(uint64 pa);
+void frame_put(uint64 pa);
+int frame_node(uint64 pa);
+int hart_node(int hart);
+int proc_node(int pid);
+uint64 kalloc(void);
+int frame_set_node(int pid, int node);
+void frame_zero_idle(void);
+void frame_stats(void);
+
+// object cache for kernel objects, see slab.c. Define one with
+// KMEM_CACHE_INIT(name, size, constructor or 0).
+typedef struct __attribute__((aligned(CACHELINE))) {
+  int n;
+  void *objs[MAGSIZE];
+  uint64 allocs, frees;
+  uint64 refills, drains; // trips to the slabs
+} magazine;
+
+typedef struct kmem_cache {
+  char *name;
+  uint64 size;
+  void (*ctor)(void *);      // sets up a new object, once per slab
+  int node;                  // NUMA node of the slabs, -1 = that of the hart
+  ticketlock lock;           // for the slabs
+  int order;                 // a slab is 2^order pages
+  int perslab;               // objects in a slab, 0 until the first one
+  struct slab *partial;      // slabs with free objects
+  uint64 slabs;
+  int listed;                // on kmem_caches
+  struct kmem_cache *next;
+  magazine mag[NCPU];
+} kmem_cache;
+
+#define KMEM_CACHE_INIT(n, sz, ctor) { n, sz, ctor, -1, TICKETLOCK_INIT(n) }
+
+void *kmem_alloc(kmem_cache *c);
+void kmem_free(kmem_cache *c, void *obj);
+void kmem_stats(void);
+
+// TLB invalidations queued for one address space. n > TLB_BATCH means
+// flush all of it.
+typedef struct {
+  int n;
+  uint64 va[TLB_BATCH];
+} tlbreq;
+
+// what other harts may read about a process without the kernel lock.
+// Published through pcbentry.info under RCU, see proc_publish.
+typedef struct {
+  int pid;
+  int group;
+  uint64 affinity;
+  int node;
+  uint64 started;    // mtime the process was started
+  uint64 version;    // bumped on every update
+} procinfo;
+
+typedef struct {
+  void (*fn)(void *);
+  void *arg;
+} rcucb;
+
+typedef struct rcublock {
+  struct rcublock *next;
+  int n;
+  rcucb cb[NRCUCB];
+} rcublock;
+
+// RCU callbacks waiting for the same grace period, in blocks from
+// rcublock_cache
+typedef struct {
+  int n;             // callbacks in all blocks
+  rcublock *blocks;  // the one filled now first
+  uint64 snap[NCPU]; // rcu_seq of every hart when the grace period started
+} rcubatch;
+
+// a BLOCKED process on a wait queue
+typedef struct waiter {
+  int pid;
+  struct waiter *next;
+} waiter;
+
+// FIFO of BLOCKED processes, with entries from waiter_cache
+typedef struct {
+  waiter *head; // woken next, 0 if empty
+  waiter *tail;
+} waitqueue;
+
+#define WAITQUEUE_INIT { 0, 0 }
+
+// named shared memory, see shm.c. Its pages are contiguous; the segment and
+// every page table mapping one hold a reference to each of them.
+typedef struct shmseg {
+  char name[SHMNAME];
+  int id;
+  uint64 pa;
+  uint64 size;
+  int nmaps;    // mappings of it, in all processes
+  int removed;  // freed with its last mapping; its name is gone already
+  struct shmseg *next; // on the list of named segments
+} shmseg;
+
+// a range of a process' address space besides its text, data and stack,
+// see vm.c. Kept in an array sorted by start, which grows as needed.
+typedef struct {
+  uint64 start, end;
+  uint64 perm;       // PTE_R/W/X | PTE_U
+  shmseg *seg;       // the shared memory mapped here, 0 for anonymous memory
+} vma;
+
+// process table entry. The fields schedule() and return_to_user() read on
+// every switch come first; accounting and limits start on a cache line of
+// their own, so updating them does not disturb the hot part.
+typedef struct __attribute__((aligned(CACHELINE))) {
   procstate_t state;
+  int hart;          // hart whose run queue the process is on, or last ran on
   uint64 pc;
-  uint64 sp;
-  uint64 physbase;
+  uint64 satp;       // satp for the address space, with ASID pid+1
+  riscv_regs regs;   // user registers, saved by ex.S while the process is not running
+
+  // cold part
+  uint64 textend __attribute__((aligned(CACHELINE))); // [0, textend) is read-only and executable
+  uint64 sz;         // [textend, sz) is data, bss and heap: sz is the break
+  uint64 heap;       // end of bss, the lowest break
+  uint64 rss;        // pages mapped
+  int nothp;         // do not back its memory with megapages
+  vma **vmas;        // further regions, sorted by address, in a block of their own
+  int nvma;
+  int maxvma;        // room in vmas
   uint64 pagetablebase;
-  uint64 wakeuptime;
+  uint64 wakeuptime; // mtime at which a SLEEPING process may be woken
+  uint64 slack;      // mtime cycles the wakeup may be deferred to batch it with others
+  itimer *timer;     // from itimer_cache once ITIMERSET armed one, else 0
+  int group;         // scheduling group
+  uint64 vruntime;   // mtime cycles run, adjusted on wakeup by the fair policy
+  uint64 lastran;    // mtime the process last stopped running
+  int rqnext, rqprev; // neighbours on the run queue of hart while READY, -1 at the ends
+  uint64 affinity;   // harts the process may run on
+  int node;          // NUMA node its memory comes from, -1 = the node of its hart
+  procinfo *info;    // RCU protected, 0 while the slot is unused
+  uint64 tlb_harts;  // harts whose TLB may hold translations of this address space
+  tlbreq tlb_batch;  // invalidations not yet sent by tlb_flush
 } pcbentry;
 
+// per-hart run queue. The READY processes on it are those whose
+// pcbentry.hart is this hart, in a list linked through pcbentry.rqnext and
+// rqprev, in the order the policy keeps them in. See sched.c.
+typedef struct {
+  ticketlock lock;     // protects the list and nr_ready
+  int head, tail;      // -1 if empty
+  int nr_ready;        // READY processes queued on this hart
+  uint64 min_vruntime; // fair policy: largest vruntime taken off the head, only grows
+  uint64 load;         // decaying average of READY + running processes, LOAD_ONE = 1
+  uint64 next_balance; // mtime of the next periodic rebalance
+  uint64 switches;     // processes dispatched on this hart
+  uint64 steals;       // processes this hart pulled from other harts
+} runqueue;
+
+// requests one hart can post to another, see ipi.c
+#define IPI_RESCHED  (1 << 0) // a process was queued for the hart, reschedule
+#define IPI_TLBFLUSH (1 << 1) // flush the pages in cpu.tlb_reqs, see tlb.c
+
+// PLIC interrupt source, see irq.c
+typedef struct {
+  void (*handler)(int irq); // 0 if no driver registered the source
+  uint64 affinity;          // harts the source may be routed to
+  int hart;                 // hart it is routed to
+  uint64 count;             // interrupts served
+  uint64 lastcount;         // count at the last rebalance
+  uint64 moves;             // times the balancer moved the source
+} irqdesc;
+
+// per-hart state. While a hart is in the kernel, tp points to its cpu struct;
+// while it runs user code, mscratch does. ex.S relies on the first three fields.
+// The first part is only written by the hart itself. What other harts write -
+// the MCS queue node, the run queue, the IPI mailbox and the TLB requests -
+// and tlb_done, which they poll, start on cache lines of their own, so that
+// posting a request does not steal the line with the hart's hot fields.
+typedef struct __attribute__((aligned(CACHELINE))) {
+  uint64 scratch;       // user t0 while ex.S saves the registers
+  riscv_regs *tf;       // trap frame of the process running on this hart
+  uint64 kstack;        // top of this hart's kernel stack
+  uint64 hartid;
+  int pid;              // process running on this hart, -1 while idle
+  int online;           // hart has been started
+  uint64 slice_end;     // mtime at which the running process is preempted
+  uint64 dispatch_time; // mtime since which the running process has not been charged
+  uint64 rcu_seq;       // odd while the hart is in an RCU read-side section
+  int rcu_nest;         // nesting depth of rcu_read_lock
+  int isolated;         // hart is in ISOLHARTS
+  int asid_flush;       // too few ASID bits for MAXPROCS: flush the TLB on every switch
+  uint64 timer_irqs;    // number of timer interrupts taken, to check coalescing
+  uint64 ipis;          // IPI_RESCHEDs received
+  uint64 ipi_latency;   // sum of their send to receive latencies in mtime cycles
+  uint64 ipi_maxlatency;
+  uint64 tlb_ipis;      // shootdown IPIs this hart sent
+  uint64 tlb_pages;     // single pages flushed on this hart
+  uint64 tlb_full;      // address spaces flushed as a whole on this hart
+  uint64 irqs_served;   // device interrupts handled on this hart
+  rcubatch rcu_next;    // callbacks collected for the next grace period
+  rcubatch rcu_wait;    // callbacks waiting for the current one
+  uint64 rcu_gps;       // grace periods this hart completed
+  uint64 rcu_cbs;       // callbacks it ran
+  uint64 faults;        // page faults served by mapping a page
+  uint64 badfaults;     // page faults that killed the process
+  pagecache pcache;
+
+  // the predecessor in the kernel_lock queue hands the lock over here
+  mcs_node kernel_node __attribute__((aligned(CACHELINE)));
+
+  // other harts queue processes here and steal them
+  runqueue rq __attribute__((aligned(CACHELINE)));
+
+  // IPI mailbox
+  uint32 ipi_pending __attribute__((aligned(CACHELINE))); // IPI_* requests from other harts
+  uint64 ipi_sent;      // mtime the pending IPI_RESCHED was sent
+
+  // TLB shootdown requests
+  ticketlock tlb_lock __attribute__((aligned(CACHELINE))); // protects tlb_reqs and tlb_seq
+  uint64 tlb_seq;       // tlb_reqs updates so far
+  tlbreq tlb_reqs[MAXPROCS]; // invalidations other harts queued for us, per address space
+  uint64 tlb_done __attribute__((aligned(CACHELINE))); // tlb_seq up to which we have flushed
+} cpu;
+
+static inline cpu *
+mycpu()
+{
+  cpu *c;
+  asm volatile("mv %0, tp" : "=r" (c) );
+  return c;
+}
+
+void acquire_kernel(void);
+void release_kernel(void);
+
+void ipi_send(int hart, uint32 req);
+void ipi_kick_idle(void);
+uint32 ipi_receive(void);
+
+void irq_hart_init(void);
+void irq_online(void);
+void irq_register(int irq, void (*handler)(int), uint64 affinity);
+int irq_set_affinity(uint64 irq, uint64 mask);
+void irq_balance(uint64 now);
+void irq_stats(void);
+void external_interrupt(void);
+
+void pt_init(void);
+uint64 *walk(uint64 pagetable, uint64 va, int alloc, int node);
+int map_page(int pid, uint64 va, uint64 pa, uint64 perm);
+int uvm_create(int pid);
+int uvm_alloc_page(int pid, uint64 va, uint64 perm);
+int vm_fault(int pid, uint64 va, uint64 cause);
+int vm_promote(int pid, uint64 va);
+void napot_split(int pid, uint64 va);
+int vm_demote(int pid, uint64 va);
+int vm_set_thp(int pid, int on);
+int uvm_fork(int parent, int child);
+int user_writable(int pid, uint64 va);
+vma *vma_find(int pid, uint64 va);
+vma *vma_insert(int pid, uint64 start, uint64 end, uint64 perm, shmseg *seg);
+void vma_remove(int pid, vma *v);
+uint64 vma_gap(int pid, uint64 size, uint64 align);
+int uvm_map_shared(int pid, uint64 va, uint64 pa, uint64 size, uint64 perm);
+int uvm_unmap(int pid, uint64 va, uint64 size);
+int copyinstr(int pid, uint64 va, char *dst, int max);
+uint64 vm_brk(int pid, uint64 brk);
+uint64 vm_mmap(int pid, uint64 va, uint64 len, uint64 prot);
+int vm_munmap(int pid, uint64 va, uint64 len);
+
+int shm_get(int pid, uint64 name, uint64 size);
+uint64 shm_map(int pid, int id, uint64 va, uint64 prot);
+int shm_unmap(int pid, uint64 va);
+int shm_remove(int id);
+void shm_unref(shmseg *seg);
+void shm_stats(void);
+void uvm_free(int pid);
+void vm_stats(void);
+uint64 user_addr(int pid, uint64 va);
+int copyout(int pid, uint64 va, void *src, uint64 n);
+void print_user_string(int pid, uint64 va);
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_synchronize(void);
+void rcu_call(void (*fn)(void *), void *arg);
+void rcu_poll(void);
+void rcu_stats(void);
+void proc_publish(int pid);
+int proc_info(uint64 pid, procinfo *out);
+
+void tlb_hart_init(void);
+void tlb_invalidate(int pid, uint64 va);
+void tlb_invalidate_all(int pid);
+void tlb_flush(int pid);
+void tlb_poll(void);
+void tlb_stats(void);
@@ -0,0 +1,143 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Read-copy-update. Readers of RCU protected data take no lock: they only
+// mark their read-side section in their hart's rcu_seq, which is odd while
+// the hart is inside one. A writer publishes a new version of the data and
+// hands the old one to rcu_call, which frees it once every hart that was
+// reading has left its section. Readers must not wait for the kernel lock
+// inside a section, as writers hold it while they wait for readers.
+//
+// Callbacks are collected per hart and a batch is started and retired from
+// schedule(), so the cost is paid at context switches, not by the readers.
+// A batch is a chain of blocks of NRCUCB callbacks from rcublock_cache, as
+// long as the frees in flight need; only without memory for another block
+// does rcu_call wait for the readers itself.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+extern cpu cpus[NCPU];
+
+// blocks go back empty, the state the constructor leaves them in
+static void rcublock_init(void *p) {
+  rcublock *k = p;
+
+  k->next = 0;
+  k->n = 0;
+}
+
+kmem_cache rcublock_cache = KMEM_CACHE_INIT("rcublock", sizeof(rcublock), rcublock_init);
+
+void rcu_read_lock(void) {
+  cpu *c = mycpu();
+
+  if (c->rcu_nest++ == 0) {
+    __atomic_store_n(&c->rcu_seq, c->rcu_seq + 1, __ATOMIC_RELAXED);
+    // writers must see us reading before we load any protected pointer
+    __sync_synchronize();
+  }
+}
+
+void rcu_read_unlock(void) {
+  cpu *c = mycpu();
+
+  if (--c->rcu_nest == 0)
+    __atomic_store_n(&c->rcu_seq, c->rcu_seq + 1, __ATOMIC_RELEASE);
+}
+
+// remember which harts are reading right now
+static void rcu_snapshot(uint64 snap[NCPU]) {
+  __sync_synchronize();
+  for (int h=0; h<NCPU; h++)
+    snap[h] = __atomic_load_n(&cpus[h].rcu_seq, __ATOMIC_ACQUIRE);
+}
+
+// have all readers of the snapshot left their sections?
+static int rcu_passed(uint64 snap[NCPU]) {
+  for (int h=0; h<NCPU; h++)
+    if ((snap[h] & 1) && __atomic_load_n(&cpus[h].rcu_seq, __ATOMIC_ACQUIRE) == snap[h])
+      return 0;
+  return 1;
+}
+
+// wait until nobody reads what was unpublished before the call
+void rcu_synchronize(void) {
+  uint64 snap[NCPU];
+
+  rcu_snapshot(snap);
+  while (!rcu_passed(snap))
+    ;
+  mycpu()->rcu_gps++;
+}
+
+static void rcu_run(rcubatch *b) {
+  while (b->blocks) {
+    rcublock *k = b->blocks;
+    for (int i=0; i<k->n; i++)
+      k->cb[i].fn(k->cb[i].arg);
+    b->blocks = k->next;
+    k->next = 0;
+    k->n = 0;
+    kmem_free(&rcublock_cache, k);
+  }
+  mycpu()->rcu_cbs += b->n;
+  b->n = 0;
+}
+
+// call fn(arg) once all current readers are done, e.g. to free the old
+// version of something just replaced. Called with the kernel lock held.
+void rcu_call(void (*fn)(void *), void *arg) {
+  rcubatch *b = &mycpu()->rcu_next;
+  rcublock *k = b->blocks;
+
+  if (k == 0 || k->n == NRCUCB) {
+    if ((k = kmem_alloc(&rcublock_cache)) == 0) {
+      // no memory to queue it: wait for the readers here
+      rcu_synchronize();
+      fn(arg);
+      mycpu()->rcu_cbs++;
+      return;
+    }
+    k->next = b->blocks;
+    b->blocks = k;
+  }
+  k->cb[k->n].fn = fn;
+  k->cb[k->n].arg = arg;
+  k->n++;
+  b->n++;
+}
+
+// called from schedule(): retire the waiting batch if its grace period has
+// passed and start the next one
+void rcu_poll(void) {
+  cpu *c = mycpu();
+
+  if (c->rcu_wait.n != 0) {
+    if (!rcu_passed(c->rcu_wait.snap))
+      return;
+    rcu_run(&c->rcu_wait);
+    c->rcu_gps++;
+  }
+  if (c->rcu_next.n != 0) {
+    c->rcu_wait = c->rcu_next;
+    c->rcu_next.n = 0;
+    c->rcu_next.blocks = 0;
+    rcu_snapshot(c->rcu_wait.snap);
+  }
+}
+
+void rcu_stats(void) {
+  for (int h=0; h<NCPU; h++) {
+    if (!cpus[h].online)
+      continue;
+    printastring("hart "); printhex(h);
+    printastring(" rcu grace periods "); printhex(cpus[h].rcu_gps);
+    printastring(" callbacks "); printhex(cpus[h].rcu_cbs);
+    printastring(" pending "); printhex(cpus[h].rcu_next.n + cpus[h].rcu_wait.n);
+    printastring("\n");
+  }
+}
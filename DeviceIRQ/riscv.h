@@ -4,6 +4,23 @@
 #define MSTATUS_MPP_U (0L << 11)
 #define MSTATUS_MIE (1L << 3)    // machine-mode interrupt enable.
 
+static inline uint64
+r_mhartid()
+{
+  uint64 x;
+  asm volatile("csrr %0, mhartid" : "=r" (x) );
+  return x;
+}
+
+// machine cycle counter
+static inline uint64
+r_mcycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, mcycle" : "=r" (x) );
+  return x;
+}
+
 static inline void
 w_mscratch(uint64 x)
 {
@@ -57,6 +74,48 @@ w_mepc(uint64 x)
   asm volatile("csrw mepc, %0" : : "r" (x));
 }
 
+// counters user mode may read
+#define MCOUNTEREN_TM (1L << 1) // rdtime
+static inline void
+w_mcounteren(uint64 x)
+{
+  asm volatile("csrw mcounteren, %0" : : "r" (x));
+}
+
+#define PGSIZE 4096 // bytes per page
+#define PGSHIFT 12  // bits of offset within a page
+#define HUGEPGSIZE (512 * PGSIZE) // an Sv39 megapage, mapped by a level 1 PTE
+#define NAPOTSIZE (16 * PGSIZE)    // a Svnapot block, mapped by 16 level 0 PTEs
+
+#define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
+#define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
+
+#define PTE_V (1L << 0) // valid
+#define PTE_R (1L << 1)
+#define PTE_W (1L << 2)
+#define PTE_X (1L << 3)
+#define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // software (RSW): shared copy-on-write, writable once copied
+#define PTE_SHARED (1L << 9) // software (RSW): shared memory, stays shared across FORK
+#define PTE_N (1ULL << 63) // Svnapot: one of 16 PTEs mapping a 64 KB block
+
+// shift a physical address to the right place for a PTE.
+#define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
+#define PTE2PA(pte) ((((pte) & ~PTE_N) >> 10) << 12)
+#define PTE_FLAGS(pte) ((pte) & 0x3FF)
+
+// extract the three 9-bit page table indices from a virtual address.
+#define PXMASK          0x1FF // 9 bits
+#define PXSHIFT(level)  (PGSHIFT+(9*(level)))
+#define PX(level, va) ((((uint64) (va)) >> PXSHIFT(level)) & PXMASK)
+
+// use riscv's sv39 page table scheme.
+#define SATP_SV39 (8L << 60)
+#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define SATP_ASID(asid) ((uint64)(asid) << 44)
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void
@@ -65,6 +124,14 @@ w_satp(uint64 x)
   asm volatile("csrw satp, %0" : : "r" (x));
 }
 
+static inline uint64
+r_satp()
+{
+  uint64 x;
+  asm volatile("csrr %0, satp" : "=r" (x) );
+  return x;
+}
+
 // Machine Interrupt Enable
 #define MIE_MEIE (1L << 11) // external
 #define MIE_MTIE (1L << 7) // timer
@@ -83,6 +150,18 @@ w_mie(uint64 x)
   asm volatile("csrw mie, %0" : : "r" (x));
 }
 
+// Machine Interrupt Pending
+#define MIP_MEIP (1L << 11) // external
+#define MIP_MTIP (1L << 7) // timer
+#define MIP_MSIP (1L << 3) // software
+static inline uint64
+r_mip()
+{
+  uint64 x;
+  asm volatile("csrr %0, mip" : "=r" (x) );
+  return x;
+}
+
 // Supervisor Interrupt Enable
 #define SIE_SEIE (1L << 9) // external
 #define SIE_STIE (1L << 5) // timer
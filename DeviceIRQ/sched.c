@@ -0,0 +1,478 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Scheduling groups and the scheduler policies. schedule() and every place
+// that changes a process' runnability go through the active schedclass, so a
+// new policy only has to provide the operations of a schedclass. Each policy
+// orders the run queues its own way and keeps its own state: round robin
+// the group cursors, the fair policy a vruntime floor per hart.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+extern pcbentry pcb[MAXPROCS];
+extern cpu cpus[NCPU];
+
+schedgroup groups[NGROUPS];
+extern schedclass *sched;
+
+// a group is throttled if it or any group above it used up its quota
+int group_throttled(int g) {
+  for (; g >= 0; g = groups[g].parent)
+    if (groups[g].throttled)
+      return 1;
+  return 0;
+}
+
+// charge the cycles the running process used since dispatch_time to it, its
+// group and all groups above it, throttling groups that exceed their quota.
+void group_charge(uint64 now) {
+  uint64 delta = now - mycpu()->dispatch_time;
+
+  mycpu()->dispatch_time = now;
+  pcb[mycpu()->pid].vruntime += delta;
+  for (int g = pcb[mycpu()->pid].group; g >= 0; g = groups[g].parent) {
+    groups[g].usage += delta;
+    groups[g].runtime += delta;
+    if (groups[g].quota != 0 && groups[g].runtime >= groups[g].quota)
+      groups[g].throttled = 1;
+  }
+}
+
+// start a new period for every group whose period has elapsed. Idle harts
+// are kicked if a throttled group may run again.
+void group_refresh(uint64 now) {
+  int unthrottled = 0;
+
+  for (int g=0; g<NGROUPS; g++) {
+    if (groups[g].used && groups[g].quota != 0 && now >= groups[g].period_start + groups[g].period) {
+      groups[g].period_start = now - (now - groups[g].period_start) % groups[g].period;
+      groups[g].runtime = 0;
+      unthrottled |= groups[g].throttled;
+      groups[g].throttled = 0;
+    }
+  }
+  if (unthrottled)
+    ipi_kick_idle();
+}
+
+// create a group below parent that may run quota mtime cycles per period
+// (quota 0 = unlimited). returns the group id or -1.
+int group_create(int parent, uint64 quota, uint64 period) {
+  if (parent < 0 || parent >= NGROUPS || !groups[parent].used)
+    return -1;
+  if (quota != 0 && period == 0)
+    return -1;
+  for (int g=1; g<NGROUPS; g++) {
+    if (!groups[g].used) {
+      groups[g].used = 1;
+      groups[g].parent = parent;
+      groups[g].quota = quota;
+      groups[g].period = period;
+      groups[g].period_start = r_mtime();
+      groups[g].runtime = 0;
+      groups[g].usage = 0;
+      groups[g].throttled = 0;
+      groups[g].cursor = 0;
+      return g;
+    }
+  }
+  return -1;
+}
+
+// ---- per-hart run queues ----
+
+// A READY process is queued on exactly one hart, pcbentry.hart, in a list
+// linked through pcbentry.rqnext/rqprev under that hart's rq.lock. The
+// policies only pick from the queue of the hart they run on; idle harts
+// steal from the tail of the busiest one and sched_balance() evens out the
+// load averages periodically. Only one run queue lock is held at a time.
+
+void sched_init(void) {
+  for (int h=0; h<NCPU; h++) {
+    cpus[h].rq.lock = (ticketlock)TICKETLOCK_INIT("runqueue");
+    cpus[h].rq.head = -1;
+    cpus[h].rq.tail = -1;
+  }
+}
+
+// link pid into rq after prev, or at the head if prev is -1. Lock held.
+static void rq_insert(runqueue *rq, int prev, int pid) {
+  int next = prev < 0 ? rq->head : pcb[prev].rqnext;
+
+  pcb[pid].rqprev = prev;
+  pcb[pid].rqnext = next;
+  if (prev < 0)
+    rq->head = pid;
+  else
+    pcb[prev].rqnext = pid;
+  if (next < 0)
+    rq->tail = pid;
+  else
+    pcb[next].rqprev = pid;
+  rq->nr_ready++;
+}
+
+// take pid off rq. Lock held.
+static void rq_unlink(runqueue *rq, int pid) {
+  if (pcb[pid].rqprev < 0)
+    rq->head = pcb[pid].rqnext;
+  else
+    pcb[pcb[pid].rqprev].rqnext = pcb[pid].rqnext;
+  if (pcb[pid].rqnext < 0)
+    rq->tail = pcb[pid].rqprev;
+  else
+    pcb[pcb[pid].rqnext].rqprev = pcb[pid].rqprev;
+  pcb[pid].rqnext = pcb[pid].rqprev = -1;
+  rq->nr_ready--;
+}
+
+// queue pid on the hart pcbentry.hart names
+void sched_enqueue(int pid) {
+  runqueue *rq = &cpus[pcb[pid].hart].rq;
+
+  ticket_acquire(&rq->lock);
+  sched->enqueue(pid);
+  ticket_release(&rq->lock);
+}
+
+// take the process to run next off this hart's queue. returns -1 if there
+// is none.
+int sched_pick(void) {
+  runqueue *rq = &mycpu()->rq;
+  int pid;
+
+  ticket_acquire(&rq->lock);
+  pid = sched->pick_next();
+  if (pid >= 0)
+    sched->dequeue(pid);
+  ticket_release(&rq->lock);
+  return pid;
+}
+
+// hart to queue a process on that becomes runnable, among the harts of its
+// affinity mask: the hart it last ran on if that is idle, as its caches may
+// still hold the working set, else an idle hart, preferably on the NUMA node
+// its memory is bound to, else the hart it last ran on anyway. If the mask
+// no longer contains that hart, the one with the fewest READY processes.
+int sched_select_hart(int pid) {
+  uint64 mask = pcb[pid].affinity;
+  int last = pcb[pid].hart;
+  int best = -1;
+
+  if ((mask & (1ULL << last)) && cpus[last].pid < 0)
+    return last;
+  for (int h=0; h<NCPU; h++) {
+    if ((mask & (1ULL << h)) && cpus[h].online && cpus[h].pid < 0)
+      if (best < 0 || (pcb[pid].node >= 0 && hart_node(h) == pcb[pid].node && hart_node(best) != pcb[pid].node))
+        best = h;
+  }
+  if (best >= 0)
+    return best;
+  if (mask & (1ULL << last))
+    return last;
+  for (int h=0; h<NCPU; h++) {
+    if ((mask & (1ULL << h)) && cpus[h].online)
+      if (best < 0 || cpus[h].rq.nr_ready < cpus[best].rq.nr_ready)
+        best = h;
+  }
+  return best >= 0 ? best : __builtin_ctzll(mask);
+}
+
+// SETAFFINITY syscall. The mask must contain a hart that is up. If it
+// excludes the hart the process runs on, the caller has to schedule(), which
+// moves it. returns 0 or -1.
+int sched_set_affinity(int pid, uint64 mask) {
+  int ok = 0;
+
+  mask &= ALLHARTS;
+  for (int h=0; h<NCPU; h++)
+    if ((mask & (1ULL << h)) && cpus[h].online)
+      ok = 1;
+  if (!ok)
+    return -1;
+  pcb[pid].affinity = mask;
+  return 0;
+}
+
+// a group with a quota needs the tick to be throttled in time
+static int group_limited(int g) {
+  for (; g >= 0; g = groups[g].parent)
+    if (groups[g].quota != 0)
+      return 1;
+  return 0;
+}
+
+// an isolated hart running a single process needs no tick: nothing else
+// could run there, so the process keeps the hart until it blocks or another
+// process is queued here, which interrupts us by IPI.
+int sched_tickless(void) {
+  return mycpu()->isolated && mycpu()->rq.nr_ready == 0 && !group_limited(pcb[mycpu()->pid].group);
+}
+
+// a process that ran within the last MIGRATION_COST cycles still has its
+// working set in that hart's caches and should stay there
+static int cache_hot(int pid, uint64 now) {
+  return now - pcb[pid].lastran < MIGRATION_COST;
+}
+
+// move the READY process at the tail of hart victim's queue, which would
+// wait longest there, to this hart. Processes whose affinity excludes this
+// hart stay, cache hot processes are only taken if allow_hot is set and no
+// cold one is there. returns the pid or -1.
+static int pull_from(int victim, int allow_hot, uint64 now) {
+  runqueue *rq = &cpus[victim].rq;
+  int pid, hot = -1;
+
+  ticket_acquire(&rq->lock);
+  for (pid = rq->tail; pid >= 0; pid = pcb[pid].rqprev) {
+    if (!(pcb[pid].affinity & (1ULL << mycpu()->hartid)))
+      continue;
+    if (!cache_hot(pid, now))
+      break;
+    if (hot < 0)
+      hot = pid;
+  }
+  if (pid < 0 && allow_hot)
+    pid = hot;
+  if (pid >= 0)
+    sched->dequeue(pid);
+  ticket_release(&rq->lock);
+
+  if (pid >= 0) {
+    pcb[pid].hart = mycpu()->hartid;
+    sched_enqueue(pid);
+    mycpu()->rq.steals++;
+  }
+  return pid;
+}
+
+// this hart has nothing to run: take work from the busiest hart that has a
+// process that may run here. A cold process is preferred, but an idle hart
+// is better for a hot one than waiting behind a running process.
+// returns the pid or -1.
+int sched_steal(void) {
+  uint64 now = r_mtime();
+  uint64 tried = 1ULL << mycpu()->hartid;
+
+  while (1) {
+    int victim = -1;
+    for (int h=0; h<NCPU; h++) {
+      if (!(tried & (1ULL << h)) && cpus[h].rq.nr_ready > 0)
+        if (victim < 0 || cpus[h].rq.nr_ready > cpus[victim].rq.nr_ready)
+          victim = h;
+    }
+    if (victim < 0)
+      return -1;
+    tried |= 1ULL << victim;
+    int pid = pull_from(victim, 1, now);
+    if (pid >= 0)
+      return pid;
+  }
+}
+
+// called on every timer interrupt: update this hart's load average and every
+// REBALANCE_INTERVAL pull a cold process from the busiest hart if its load is
+// more than one process above ours.
+void sched_balance(uint64 now) {
+  runqueue *rq = &mycpu()->rq;
+  uint64 nr = rq->nr_ready + (mycpu()->pid >= 0);
+  int busiest = -1;
+
+  // load = 7/8 load + 1/8 nr, in units of LOAD_ONE
+  rq->load = (rq->load * 7 + (nr << LOAD_SHIFT)) / 8;
+
+  if (now < rq->next_balance)
+    return;
+  rq->next_balance = now + REBALANCE_INTERVAL;
+  for (int h=0; h<NCPU; h++) {
+    if (cpus[h].online && h != mycpu()->hartid)
+      if (busiest < 0 || cpus[h].rq.load > cpus[busiest].rq.load)
+        busiest = h;
+  }
+  if (busiest >= 0 && cpus[busiest].rq.load > rq->load + LOAD_ONE)
+    pull_from(busiest, 0, now);
+}
+
+// print the per-hart scheduler counters, for the benchmarks. SCHEDSTATS runs
+// this without the kernel lock, the counters are read as they are.
+void sched_stats(void) {
+  printastring("mtime "); printhex(r_mtime()); printastring("\n");
+  for (int h=0; h<NCPU; h++) {
+    if (!cpus[h].online)
+      continue;
+    printastring("hart "); printhex(h);
+    printastring(" switches "); printhex(cpus[h].rq.switches);
+    printastring(" steals "); printhex(cpus[h].rq.steals);
+    printastring(" timer irqs "); printhex(cpus[h].timer_irqs);
+    printastring(" load "); printhex(cpus[h].rq.load);
+    printastring(" ipis "); printhex(cpus[h].ipis);
+    printastring(" ipi latency max "); printhex(cpus[h].ipi_maxlatency);
+    printastring(" avg "); printhex(cpus[h].ipis ? cpus[h].ipi_latency / cpus[h].ipis : 0);
+    printastring("\n");
+  }
+}
+
+// ---- round robin policy ----
+
+// the member of group g whose turn it is when pid runs: pid itself if it is
+// in g, MAXPROCS + the child group of g above it if it is further down, -1
+// if it is not below g at all
+static int group_member(int g, int pid) {
+  int c = pcb[pid].group;
+
+  if (c == g)
+    return pid;
+  while (c >= 0 && groups[c].parent != g)
+    c = groups[c].parent;
+  return c < 0 ? -1 : MAXPROCS + c;
+}
+
+// pick a READY process below group g from this hart's run queue. The members
+// of a group - its processes and its child groups - take turns, so every
+// child group gets the same share of slices as a single process, no matter
+// how many processes it contains. Entities 0..MAXPROCS-1 are processes,
+// MAXPROCS.. are groups. Run queue lock held.
+int group_pick(int g) {
+  int n = MAXPROCS + NGROUPS;
+  int best = -1, bestdist = n;
+
+  // the member following the cursor that has a runnable process
+  for (int pid = mycpu()->rq.head; pid >= 0; pid = pcb[pid].rqnext) {
+    int e = group_member(g, pid);
+    if (e < 0 || group_throttled(pcb[pid].group))
+      continue;
+    int dist = (e - groups[g].cursor - 1 + n) % n;
+    if (dist < bestdist) {
+      best = e;
+      bestdist = dist;
+    }
+  }
+#ifdef DEBUG
+  printastring("> Group "); printhex(g); printastring(": "); printhex(best); printastring("\n");
+#endif
+  if (best < 0)
+    return -1;
+  groups[g].cursor = best;
+  return best < MAXPROCS ? best : group_pick(best - MAXPROCS);
+}
+
+// at the tail of its hart's queue
+static void rr_enqueue(int pid) {
+  runqueue *rq = &cpus[pcb[pid].hart].rq;
+
+  rq_insert(rq, rq->tail, pid);
+}
+
+static void rr_dequeue(int pid) {
+  rq_unlink(&cpus[pcb[pid].hart].rq, pid);
+}
+
+static int rr_pick_next(void) {
+  return group_pick(0);
+}
+
+static int rr_tick(uint64 now) {
+  return now >= mycpu()->slice_end;
+}
+
+// a woken process simply queues up behind the others: no wakeup operation
+schedclass rr_class = { "rr", rr_enqueue, rr_dequeue, rr_pick_next, rr_tick, 0 };
+
+// ---- fair policy ----
+
+// run the READY process that has had the least CPU time (vruntime). Every
+// hart's queue is kept sorted by vruntime, so that is the first one whose
+// groups are not throttled. Group quotas still apply, but groups do not get
+// a share of their own here.
+
+// in vruntime order, behind those with the same vruntime
+static void fair_enqueue(int pid) {
+  runqueue *rq = &cpus[pcb[pid].hart].rq;
+  int prev = rq->tail;
+
+  while (prev >= 0 && pcb[prev].vruntime > pcb[pid].vruntime)
+    prev = pcb[prev].rqprev;
+  rq_insert(rq, prev, pid);
+}
+
+// taking the head off raises the hart's vruntime floor, see fair_wakeup
+static void fair_dequeue(int pid) {
+  runqueue *rq = &cpus[pcb[pid].hart].rq;
+
+  if (pid == rq->head && pcb[pid].vruntime > rq->min_vruntime)
+    rq->min_vruntime = pcb[pid].vruntime;
+  rq_unlink(rq, pid);
+}
+
+// the first process of this hart's queue whose groups may run
+static int fair_first(void) {
+  int pid = mycpu()->rq.head;
+
+  while (pid >= 0 && group_throttled(pcb[pid].group))
+    pid = pcb[pid].rqnext;
+  return pid;
+}
+
+static int fair_pick_next(void) {
+  return fair_first();
+}
+
+// preempt at the end of the slice, or as soon as the running process is a
+// whole slice ahead of the first one waiting here
+static int fair_tick(uint64 now) {
+  uint64 vr = pcb[mycpu()->pid].vruntime + (now - mycpu()->dispatch_time);
+  int first, ahead;
+
+  if (now >= mycpu()->slice_end)
+    return 1;
+  ticket_acquire(&mycpu()->rq.lock);
+  first = fair_first();
+  ahead = first >= 0 && vr > pcb[first].vruntime + SLICE_TICKS * TICK_INTERVAL;
+  ticket_release(&mycpu()->rq.lock);
+  return ahead;
+}
+
+// a process that slept for a long time must not monopolise the CPU until its
+// vruntime caught up, so it restarts from the vruntime floor of the hart it
+// is queued on: the largest vruntime that was ever at the head there.
+static void fair_wakeup(int pid) {
+  runqueue *rq = &cpus[pcb[pid].hart].rq;
+
+  if (pcb[pid].vruntime < rq->min_vruntime)
+    pcb[pid].vruntime = rq->min_vruntime;
+}
+
+schedclass fair_class = { "fair", fair_enqueue, fair_dequeue, fair_pick_next, fair_tick, fair_wakeup };
+
+schedclass *schedclasses[] = { &rr_class, &fair_class };
+schedclass *sched = &rr_class;
+
+// switch the system to policy nr, moving every READY process over to it.
+// returns the previous policy or -1 if nr is invalid.
+int sched_switch(uint64 nr) {
+  int old;
+
+  if (nr >= sizeof(schedclasses) / sizeof(schedclasses[0]))
+    return -1;
+  for (old=0; schedclasses[old] != sched; old++)
+    ;
+  for (int h=0; h<NCPU; h++) {
+    runqueue *rq = &cpus[h].rq;
+    int queued[MAXPROCS], n = 0;
+
+    ticket_acquire(&rq->lock);
+    while (rq->head >= 0) {
+      queued[n] = rq->head;
+      sched->dequeue(queued[n++]);
+    }
+    for (int i=0; i<n; i++)
+      schedclasses[nr]->enqueue(queued[i]);
+    ticket_release(&rq->lock);
+  }
+  sched = schedclasses[nr];
+  return old;
+}
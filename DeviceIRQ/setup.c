@@ -1,5 +1,6 @@
 #include "types.h"
 #include "riscv.h"
+#include "spinlock.h"
 #include "kernel.h"
 #include "hardware.h"
 
@@ -8,134 +9,196 @@ extern void ex(void);
 extern void printastring(char *);
 extern void printhex(uint64);
 
+extern void exret(riscv_regs *);
+extern riscv_regs *return_to_user(void);
+extern void schedule(void);
+
 extern pcbentry pcb[MAXPROCS];
-extern uint64 current_pid;
+extern cpu cpus[NCPU];
+extern char stack0[NCPU][4096];
+extern void sched_wakeup(int pid);
+extern schedgroup groups[NGROUPS];
+extern void uart_interrupt(int irq);
+extern volatile struct uart* uart0;
+
+volatile int started = 0; // set by hart 0 once the shared kernel state is set up
 
 #define NPROC 8 
-#define PGSHIFT 12
-#define PERMSHIFT 10
-#define PERM_V 0
-#define PERM_X 3
-#define PERM_W 2
-#define PERM_R 1
-#define PERM_U 4
-
-__attribute__ ((aligned (4096))) uint64 pt[NPROC][512*3];
-
-uint64 init_pt(int proc) { 
-  for (int i=0; i<512; i++) {
-    if (i == 0) {
-      pt[proc][i] = ((uint64)&pt[proc][512]) >> PGSHIFT << PERMSHIFT;
-      pt[proc][i] |= (1 << PERM_V);
-#ifdef DEBUG
-printastring("PT0 = ");
-printhex(pt[proc][i]);
-printastring("\n");
-#endif
-    } else {
-      pt[proc][i] = 0;
-    }
+#define SLOTSIZE 0x200000 // the loader puts program i at ram_base + (i+1) * SLOTSIZE
+
+// copy the program qemu loaded into slot (-device loader) into a new address
+// space for pid. userentry.S puts a header at the start of every program:
+// a jump over it, UPROG_MAGIC, the end of the text pages and the end of bss.
+// The binary ends with its last non-zero word; the pages of bss behind it
+// and of the stack are allocated when the program touches them.
+// returns 0 or -1 if slot holds no program or we ran out of memory.
+static int proc_load(int pid, uint64 slot) {
+  uint64 *w = (uint64 *)slot;
+  uint64 size = SLOTSIZE;
+
+  if (w[1] != UPROG_MAGIC || w[2] > w[3] || w[2] > SLOTSIZE || w[3] > USTACK_TOP - USTACK_SIZE) {
+    printastring("no program header in slot "); printhex(pid); printastring("\n");
+    return -1;
   }
-  for (int i=512; i<1024; i++) {
-    if (i == 512) {
-      pt[proc][i] = (0x80000000ULL + (proc+1) * 0x200000ULL) >> PGSHIFT << PERMSHIFT;
-      pt[proc][i] |= 0x7f; // (1 << PERM_V) | (1 << PERM_R) | (1 << PERM_W) | (1 << PERM_X) | (1<<PERM_U) | (1 <<PERM_A) | (1<<PERM_D);
-#ifdef DEBUG
-printastring("PT1 = ");
-printhex(pt[proc][i]);
-printastring("\n");
-#endif
-    } else {
-      pt[proc][i] = 0;
-    }
+  while (size > 0 && w[size/8 - 1] == 0)
+    size -= 8;
+  if (uvm_create(pid) < 0)
+    return -1;
+  pcb[pid].textend = PGROUNDUP(w[2]);
+  pcb[pid].sz = w[3];
+  pcb[pid].heap = w[3];
+
+  for (uint64 va = 0; va < size; va += PGSIZE) {
+    uint64 perm = va < pcb[pid].textend ? PTE_R | PTE_X | PTE_U : PTE_R | PTE_W | PTE_U;
+    if (uvm_alloc_page(pid, va, perm) < 0)
+      return -1;
+    // a fresh page; the loader may write it whatever its permissions
+    char *dst = (char *)user_addr(pid, va);
+    for (uint64 i = 0; i < PGSIZE && va + i < size; i++)
+      dst[i] = ((char *)slot)[va + i];
   }
-  return (uint64)&pt[proc][0];
-}
-
-void interruptinit(void) {
-  // set desired IRQ priorities non-zero (otherwise disabled).
-  *(uint32*)(PLIC + UART0_IRQ*4) = 1;
-     
-  // set uart's enable bit for this hart's M-mode.
-  *(uint32*)PLIC_MENABLE = (1 << UART0_IRQ);
-  
-  // set this hart's M-mode priority threshold to 0.
-  *(uint32*)PLIC_MPRIORITY = 0; 
-
-  // enable machine-mode external interrupts.
-  w_mie(r_mie() | MIE_MEIE);
+  // the image in 64 KB blocks where it can
+  for (uint64 va = 0; va < size; va += NAPOTSIZE)
+    vm_promote(pid, va);
+  pcb[pid].regs.sp = USTACK_TOP;
+  return 0;
 }
 
 void timerinit(void) {
-  // we only have one CPU...
-  int id = 0;
+  // every hart has its own mtimecmp register in the CLINT.
+  int id = mycpu()->hartid;
 
-  // ask the CLINT for a timer interrupt.
-  int interval = 2000; // cycles; about 1/10th second in qemu.
-  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
+  // ask the CLINT for a timer interrupt at the end of the first slice.
+  mycpu()->dispatch_time = r_mtime();
+  mycpu()->slice_end = mycpu()->dispatch_time + SLICE_TICKS * TICK_INTERVAL;
+  *(uint64*)CLINT_MTIMECMP(id) = mycpu()->slice_end;
 
-  // enable machine-mode interrupts.
-  w_mstatus(r_mstatus() | MSTATUS_MIE);
+  // machine-mode interrupts are always taken while we are in user mode, so
+  // mstatus.MIE stays off: the kernel never gets interrupted itself.
 
   // enable machine-mode timer interrupts.
   w_mie(r_mie() | MIE_MTIE);
 }
 
-void setup(void) {
+// a0 is the FDT address qemu passed in a1, see boot.S
+void setup(uint64 dtb) {
+  uint64 id = r_mhartid();
+  cpu *c = &cpus[id];
+
+  // tp points to this hart's cpu struct while we are in the kernel,
+  // mscratch while the hart runs user code (see ex.S).
+  c->hartid = id;
+  c->kstack = (uint64)stack0[id] + sizeof(stack0[id]);
+  c->pid = -1;
+  c->isolated = (ISOLHARTS >> id) & 1;
+  asm volatile("mv tp, %0" : : "r" (c));
+  w_mscratch((uint64)c);
+
   // set M Previous Privilege mode to User so mret returns to user mode.
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
   x |= MSTATUS_MPP_U;
   w_mstatus(x);
 
-  // enable machine-mode interrupts.
-  w_mstatus(r_mstatus() | MSTATUS_MIE);
-
   // enable software interrupts (ecall) in M mode.
   w_mie(r_mie() | MIE_MSIE);
 
   // set the machine-mode trap handler to jump to function "ex" when a trap occurs.
   w_mtvec((uint64)ex);
 
-  // enable paging now!
-  for (int i = 0; i < NPROC; i++) {
-    pcb[i].pc = 0;
-    pcb[i].sp = 0x1ffff8 - 256;
-    pcb[i].physbase = 0x80200000ULL + 0x200000 * i;
-    pcb[i].pagetablebase = init_pt(i);
-    pcb[i].state = NONE;
-    pcb[i].wakeuptime = 0;
-  } 
-
-  #define SATP_SV39 (8L << 60)
-  #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
-  w_satp(MAKE_SATP((uint64)&pt[0][0]));
-  asm volatile("sfence.vma zero, zero");
-
   // configure Physical Memory Protection to give user mode access to all of physical memory.
   w_pmpaddr0(0x3fffffffffffffULL);
   w_pmpcfg0(0xf);
 
-  // set M Exception Program Counter to main, for mret, requires gcc -mcmodel=medany
-  w_mepc((uint64)0);
+  // let user mode read mtime with rdtime, for the benchmarks
+  w_mcounteren(MCOUNTEREN_TM);
+
+  if (id == 0) {
+    // find out where memory and the devices are before we touch any of them
+    if (fdt_parse(dtb) < 0)
+      printastring("fdt: no usable device tree, assuming qemu virt\n");
+    uart0 = (volatile struct uart *)boot.uart;
+    frame_init();
+    pt_init();
+
+    // enable paging now!
+    for (int i = 0; i < NPROC; i++) {
+      pcb[i].pc = 0;
+      pcb[i].hart = 0; // idle harts steal from hart 0 once they are up
+      pcb[i].node = -1;
+      pcb[i].pagetablebase = 0;
+      pcb[i].state = NONE;
+      pcb[i].wakeuptime = 0;
+      pcb[i].slack = 0;
+      pcb[i].timer = 0;
+      pcb[i].rqnext = pcb[i].rqprev = -1;
+      pcb[i].group = 0;
+      pcb[i].vruntime = 0;
+      pcb[i].affinity = ALLHARTS & ~ISOLHARTS;
+      pcb[i].nothp = 0;
+    } 
+
+    // empty run queues for all harts, before processes are queued on them
+    sched_init();
+
+    // every process starts in the unlimited root group
+    groups[0].used = 1;
+    groups[0].parent = -1;
+    groups[0].quota = 0;
+    groups[0].cursor = -1; // so that round robin starts with pid 0
+
+    // a process slot qemu loaded a program into (-device loader) is runnable.
+    // Slots beyond the end of memory or on top of the FDT are not.
+    for (int i = 0; i < NPROC; i++) {
+      uint64 slot = boot.ram_base + SLOTSIZE * (i+1);
+      if (slot + SLOTSIZE > boot.ram_base + boot.ram_size)
+        continue;
+      if (boot.fdt && slot < boot.fdt + boot.fdt_size && boot.fdt < slot + SLOTSIZE)
+        continue;
+      if (*(uint32*)slot != 0 && proc_load(i, slot) == 0) {
+        sched_wakeup(i);
+        proc_publish(i);
+      }
+    }
+    // the programs are copied out, their slots are free memory now
+    frame_add(boot.ram_base + SLOTSIZE, boot.ram_base + SLOTSIZE * (NPROC+1));
+
+    // init the PLIC interrupts. Every hart can take device interrupts; the
+    // UART starts on hart 0, sources registered later are spread over the
+    // harts as they come up.
+    irq_hart_init();
+    irq_register(boot.uart_irq, uart_interrupt, ALLHARTS);
+
+    // enable uart rx irqs
+    uart0->IER=0x1;
+
+    __sync_synchronize();
+    started = 1;
+  } else {
+    while (started == 0)
+      ;
+    __sync_synchronize();
+    // harts beyond those the device tree lists never come online: nothing
+    // is queued on them and no interrupts are routed to them
+    if (id >= boot.nharts)
+      while (1)
+        asm volatile("wfi");
+    irq_hart_init();
+  }
 
-  current_pid = 0;
-  pcb[0].state = RUNNING;
-  pcb[1].state = READY;
-  pcb[2].state = READY;
-  w_mscratch(pcb[0].physbase);
+  // how wide this hart's ASIDs are decides whether switches flush the TLB
+  tlb_hart_init();
 
   // init the timer
   timerinit();
-
-  // init the PLIC interrupts
-  interruptinit();
-
-  // enable uart rx irqs
-  extern volatile struct uart* uart0;
-  uart0->IER=0x1;
-
-  // switch to user mode (configured in mstatus) and jump to address in mepc CSR -> main().
-  asm volatile("mret");
+  c->online = 1;
+
+  // pick a process for this hart - or idle until there is one - and switch
+  // to user mode (configured in mstatus) at its pc.
+  acquire_kernel();
+  irq_online();
+  schedule();
+  riscv_regs *regs = return_to_user();
+  release_kernel();
+  exret(regs);
 }
-
@@ -0,0 +1,184 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+#include "syscalls.h"
+
+// Named shared memory. SHMGET creates a segment of up to 2 MB, or finds
+// the one of that name; SHMMAP maps it into the caller with read or
+// read/write access, at an address it asks for or one the kernel picks;
+// SHMUNMAP removes a mapping. The processes then share the frames, nothing
+// is copied. A segment lives until SHMREMOVE was called and its last
+// mapping is gone. FORK hands the mappings of the parent to the child.
+//
+// The pages of a segment are one buddy block, split into single pages so
+// that each can be counted and freed on its own. The kernel places a
+// mapping at an address aligned like the block, so that Svnapot can map it
+// in 64 KB pieces.
+//
+// Segments come from an object cache and the named ones are kept in a
+// list, so their number is only limited by memory. Ids count up and are
+// not reused. VMSTATS walks the list without the kernel lock, so segments
+// are published with a release store and freed through RCU.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+extern pcbentry pcb[MAXPROCS];
+
+shmseg *shms;      // the segments that still have a name, newest first
+static int nextid;
+kmem_cache shm_cache = KMEM_CACHE_INIT("shmseg", sizeof(shmseg), 0);
+
+static int shm_order(uint64 size) {
+  int order = 0;
+
+  while ((PGSIZE << order) < size)
+    order++;
+  return order;
+}
+
+// the named segment id, 0 if there is none
+static shmseg *shm_lookup(int id) {
+  for (shmseg *seg = shms; seg; seg = seg->next)
+    if (seg->id == id)
+      return seg;
+  return 0;
+}
+
+static void seg_free(void *seg) {
+  kmem_free(&shm_cache, seg);
+}
+
+static void shm_free(shmseg *seg) {
+  for (uint64 off = 0; off < seg->size; off += PGSIZE)
+    frame_put(seg->pa + off);
+  rcu_call(seg_free, seg);
+}
+
+// SHMGET syscall: the id of the segment called by the string at user
+// address name of pid. If there is none and size is not 0, create one of
+// size bytes, zeroed. returns -1 if there is none, the name is too long or
+// there is no memory left.
+int shm_get(int pid, uint64 name, uint64 size) {
+  char s[SHMNAME];
+
+  if (copyinstr(pid, name, s, SHMNAME) < 0)
+    return -1;
+  for (shmseg *seg = shms; seg; seg = seg->next) {
+    int k = 0;
+    while (k < SHMNAME && seg->name[k] == s[k] && s[k])
+      k++;
+    if (k < SHMNAME && seg->name[k] == s[k])
+      return seg->id;
+  }
+  if (size == 0 || size > HUGEPGSIZE || nextid < 0)
+    return -1;
+
+  size = PGROUNDUP(size);
+  shmseg *seg = kmem_alloc(&shm_cache);
+  if (seg == 0)
+    return -1;
+  uint64 order = shm_order(size);
+  seg->pa = page_alloc(order, proc_node(pid));
+  if (seg->pa == 0) {
+    kmem_free(&shm_cache, seg);
+    return -1;
+  }
+  page_split(seg->pa);
+  for (uint64 off = 0; off < (PGSIZE << order); off += PGSIZE) {
+    if (off >= size) {
+      frame_free(seg->pa + off); // the rest of the block
+      continue;
+    }
+    for (int k=0; k<PGSIZE/8; k++)
+      ((uint64 *)(seg->pa + off))[k] = 0;
+  }
+  for (int k=0; k<SHMNAME; k++)
+    seg->name[k] = s[k];
+  seg->size = size;
+  seg->nmaps = 0;
+  seg->removed = 0;
+  seg->id = nextid++;
+  seg->next = shms;
+  __atomic_store_n(&shms, seg, __ATOMIC_RELEASE);
+  return seg->id;
+}
+
+// SHMMAP syscall: map segment id into pid at va, or where there is room if
+// va is 0, readable and, with SHM_WRITE in prot, writable. returns the
+// address, or -1 if there is no such segment, va is not page aligned or
+// in use, or there is no memory for the page tables.
+uint64 shm_map(int pid, int id, uint64 va, uint64 prot) {
+  shmseg *seg;
+  uint64 perm = PTE_R | PTE_U;
+  vma *v;
+
+  if ((seg = shm_lookup(id)) == 0 || !(prot & (SHM_READ | SHM_WRITE)))
+    return -1;
+  if (prot & SHM_WRITE)
+    perm |= PTE_W;
+  if (va == 0) {
+    uint64 align = PGSIZE << shm_order(seg->size);
+    if ((va = vma_gap(pid, seg->size, align)) == 0)
+      return -1;
+  } else if (va & (PGSIZE - 1)) {
+    return -1;
+  }
+  if ((v = vma_insert(pid, va, va + seg->size, perm, seg)) == 0)
+    return -1;
+  if (uvm_map_shared(pid, va, seg->pa, seg->size, perm) < 0) {
+    vma_remove(pid, v);
+    return -1;
+  }
+  seg->nmaps++;
+  return va;
+}
+
+// SHMUNMAP syscall: remove the mapping of shared memory at va from pid.
+// returns 0 or -1 if no mapping starts there or it cannot be unmapped.
+int shm_unmap(int pid, uint64 va) {
+  vma *v = vma_find(pid, va);
+
+  if (v == 0 || v->seg == 0 || v->start != va)
+    return -1;
+  if (uvm_unmap(pid, v->start, v->end - v->start) < 0)
+    return -1;
+  shm_unref(v->seg);
+  vma_remove(pid, v);
+  return 0;
+}
+
+// SHMREMOVE syscall: forget the name of segment id, free it once the last
+// mapping of it is gone. returns 0 or -1 if there is no such segment.
+int shm_remove(int id) {
+  shmseg **pp = &shms;
+  shmseg *seg;
+
+  while (*pp && (*pp)->id != id)
+    pp = &(*pp)->next;
+  if ((seg = *pp) == 0)
+    return -1;
+  __atomic_store_n(pp, seg->next, __ATOMIC_RELEASE);
+  seg->removed = 1;
+  if (seg->nmaps == 0)
+    shm_free(seg);
+  return 0;
+}
+
+// a mapping of seg is gone
+void shm_unref(shmseg *seg) {
+  if (--seg->nmaps == 0 && seg->removed)
+    shm_free(seg);
+}
+
+void shm_stats(void) {
+  for (shmseg *seg = __atomic_load_n(&shms, __ATOMIC_ACQUIRE); seg; seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE)) {
+    printastring("shm "); printhex(seg->id);
+    printastring(" "); printastring(seg->name);
+    printastring(" size "); printhex(seg->size);
+    printastring(" mappings "); printhex(seg->nmaps);
+    printastring("\n");
+  }
+}
@@ -0,0 +1,209 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Object caches for kernel objects. A cache hands out objects of one size,
+// carved from slabs: blocks of 2^order pages, aligned to their size, that
+// hold a slab header, a stack of the indices of its free objects and the
+// objects. The order is the smallest that fits 8 objects, up to
+// SLAB_MAXORDER, so a page table cache gets 7 pages of every 8; objects of
+// a multiple of the page size stay page aligned behind a page for the
+// header. Objects that do not fit an order SLAB_MAXORDER slab are never
+// handed out; kmem_alloc fails for them.
+//
+// The constructor of a cache, if it has one, runs once per object when its
+// slab is made. Objects have to go back to the cache in the state it left
+// them in, so that state costs nothing on kmem_alloc; everything else the
+// caller sets up itself.
+//
+// Every hart keeps a magazine of free objects per cache. Allocations and
+// frees only take the cache's lock to refill or drain half a magazine from
+// or to the slabs. A slab whose objects are all free is given back to the
+// frame allocator unless it is the last one with free objects.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+extern cpu cpus[NCPU];
+
+typedef struct slab {
+  struct slab *next, *prev; // on the cache's list of slabs with free objects
+  uint64 objs;              // address of the first object
+  int total;                // objects in the slab
+  int nfree;
+  uint16 free[];            // indices of the free objects, a stack
+} slab;
+
+kmem_cache *kmem_caches; // all caches that ever had a slab, for kmem_stats
+
+static void slab_unlink(kmem_cache *c, slab *s) {
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+}
+
+static void slab_link(kmem_cache *c, slab *s) {
+  s->prev = 0;
+  s->next = c->partial;
+  if (s->next)
+    s->next->prev = s;
+  c->partial = s;
+}
+
+static uint64 obj_size(kmem_cache *c) {
+  if (c->size >= PGSIZE)
+    return PGROUNDUP(c->size);
+  return (c->size + 7) & ~7ULL;
+}
+
+// objects in a slab of c of 2^order pages; *first is the offset of the
+// first one
+static int slab_fit(kmem_cache *c, int order, uint64 *first) {
+  uint64 bytes = PGSIZE << order, size = obj_size(c);
+  int n;
+
+  if (size >= PGSIZE) {
+    *first = PGSIZE;
+    return (bytes - PGSIZE) / size;
+  }
+  n = (bytes - sizeof(slab) - 8) / (size + sizeof(uint16));
+  *first = (sizeof(slab) + n * sizeof(uint16) + 7) & ~7ULL;
+  return n;
+}
+
+// the slab obj of c is in
+static slab *slab_of(kmem_cache *c, void *obj) {
+  return (slab *)((uint64)obj & ~((PGSIZE << c->order) - 1));
+}
+
+// make a new slab for c. Cache lock held. returns 0 if there is no memory
+// or not even one object fits.
+static slab *slab_grow(kmem_cache *c) {
+  uint64 size = obj_size(c), first;
+  int node = c->node >= 0 ? c->node : hart_node(mycpu()->hartid);
+  int n;
+  slab *s;
+
+  // the order is fixed with the first slab, kmem_free relies on it
+  if (c->perslab == 0)
+    while (c->order < SLAB_MAXORDER && slab_fit(c, c->order, &first) < 8)
+      c->order++;
+  n = slab_fit(c, c->order, &first);
+  c->perslab = n;
+  if (n <= 0 || (s = (slab *)page_alloc(c->order, node)) == 0)
+    return 0;
+  // page_alloc falls back to other nodes, a cache bound to one may not
+  if (c->node >= 0 && frame_node((uint64)s) != c->node) {
+    page_free((uint64)s);
+    return 0;
+  }
+  s->total = n;
+  s->nfree = n;
+  s->objs = (uint64)s + first;
+  for (int i=0; i<n; i++) {
+    s->free[i] = n - 1 - i;
+    if (c->ctor)
+      c->ctor((void *)(s->objs + i * size));
+  }
+  if (c->slabs++ == 0 && !c->listed) {
+    c->listed = 1;
+    c->next = kmem_caches;
+    __atomic_store_n(&kmem_caches, c, __ATOMIC_RELEASE); // kmem_stats reads it without a lock
+  }
+  slab_link(c, s);
+  return s;
+}
+
+// an object of one of c's slabs, 0 if there is no memory left. Cache lock held.
+static void *slab_take(kmem_cache *c) {
+  slab *s = c->partial;
+  uint64 size = obj_size(c);
+
+  if (s == 0 && (s = slab_grow(c)) == 0)
+    return 0;
+  void *obj = (void *)(s->objs + s->free[--s->nfree] * size);
+  if (s->nfree == 0)
+    slab_unlink(c, s);
+  return obj;
+}
+
+// give obj back to its slab. Cache lock held.
+static void slab_put(kmem_cache *c, void *obj) {
+  slab *s = slab_of(c, obj);
+  uint64 size = obj_size(c);
+
+  if (s->nfree == 0)
+    slab_link(c, s);
+  s->free[s->nfree++] = ((uint64)obj - s->objs) / size;
+  if (s->nfree == s->total && (s->next || s->prev)) {
+    slab_unlink(c, s);
+    page_free((uint64)s);
+    c->slabs--;
+  }
+}
+
+// allocate an object of c. returns 0 if there is no memory.
+void *kmem_alloc(kmem_cache *c) {
+  magazine *m = &c->mag[mycpu()->hartid];
+
+  if (m->n == 0) {
+    void *obj;
+
+    ticket_acquire(&c->lock);
+    while (m->n < MAGSIZE / 2 && (obj = slab_take(c)) != 0)
+      m->objs[m->n++] = obj;
+    ticket_release(&c->lock);
+    m->refills++;
+    if (m->n == 0)
+      return 0;
+  }
+  m->allocs++;
+  return m->objs[--m->n];
+}
+
+// give obj back to c. It has to be in the state the constructor left it.
+void kmem_free(kmem_cache *c, void *obj) {
+  magazine *m = &c->mag[mycpu()->hartid];
+
+  if (m->n == MAGSIZE) {
+    ticket_acquire(&c->lock);
+    while (m->n > MAGSIZE / 2)
+      slab_put(c, m->objs[--m->n]);
+    ticket_release(&c->lock);
+    m->drains++;
+  }
+  m->objs[m->n++] = obj;
+  m->frees++;
+}
+
+// per cache: objects in use, slabs, and how often a magazine had to go to
+// the slabs
+void kmem_stats(void) {
+  for (kmem_cache *c = __atomic_load_n(&kmem_caches, __ATOMIC_ACQUIRE); c; c = c->next) {
+    uint64 allocs = 0, frees = 0, refills = 0, drains = 0;
+
+    for (int h=0; h<NCPU; h++) {
+      allocs += c->mag[h].allocs;
+      frees += c->mag[h].frees;
+      refills += c->mag[h].refills;
+      drains += c->mag[h].drains;
+    }
+    printastring("cache "); printastring(c->name);
+    if (c->node >= 0) {
+      printastring(" node "); printhex(c->node);
+    }
+    printastring(" size "); printhex(c->size);
+    printastring(" per slab "); printhex(c->perslab);
+    printastring(" in use "); printhex(allocs - frees);
+    printastring(" slabs "); printhex(c->slabs);
+    printastring(" allocs "); printhex(allocs);
+    printastring(" refills "); printhex(refills);
+    printastring(" drains "); printhex(drains);
+    printastring("\n");
+  }
+}
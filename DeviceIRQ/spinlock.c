@@ -0,0 +1,141 @@
+#include "types.h"
+#include "riscv.h"
+#include "spinlock.h"
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+// turn machine interrupts off, returning whether they were on
+static uint64 intr_off(void) {
+  uint64 x = r_mstatus();
+  w_mstatus(x & ~MSTATUS_MIE);
+  return x & MSTATUS_MIE;
+}
+
+static void intr_restore(uint64 intr) {
+  if (intr)
+    w_mstatus(r_mstatus() | MSTATUS_MIE);
+}
+
+#ifdef LOCKSTAT
+static uint64 stat_start(void) {
+  return r_mcycle();
+}
+
+static void stat_acquired(lockstat *s, uint64 start, int contended) {
+  uint64 now = r_mcycle();
+
+  s->acquired++;
+  if (contended) {
+    s->contended++;
+    s->spin += now - start;
+  }
+  s->since = now;
+}
+
+static void stat_release(lockstat *s) {
+  uint64 held = r_mcycle() - s->since;
+
+  if (held > s->maxhold)
+    s->maxhold = held;
+}
+#else
+static uint64 stat_start(void) {
+  return 0;
+}
+
+static void stat_acquired(lockstat *s, uint64 start, int contended) {
+}
+
+static void stat_release(lockstat *s) {
+}
+#endif
+
+void ticket_acquire(ticketlock *l) {
+  ticket_acquire_poll(l, 0);
+}
+
+// like ticket_acquire, but call poll() while we wait, for work the holder
+// of the lock - or of a lock the holder waits for - may be waiting for
+void ticket_acquire_poll(ticketlock *l, void (*poll)(void)) {
+  uint64 intr = intr_off();
+  uint64 start = stat_start();
+
+  // amoadd.w.aq hands out the tickets
+  uint32 ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_ACQUIRE);
+  int contended = 0;
+
+  while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket) {
+    contended = 1;
+    if (poll)
+      poll();
+  }
+  l->intr = intr;
+  stat_acquired(&l->stat, start, contended);
+}
+
+void ticket_release(ticketlock *l) {
+  uint64 intr = l->intr;
+
+  stat_release(&l->stat);
+  __atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+  intr_restore(intr);
+}
+
+void mcs_acquire(mcslock *l, mcs_node *node) {
+  mcs_acquire_poll(l, node, 0);
+}
+
+// like mcs_acquire, but call poll() while we wait, for work the holder of
+// the lock may be waiting for
+void mcs_acquire_poll(mcslock *l, mcs_node *node, void (*poll)(void)) {
+  uint64 intr = intr_off();
+  uint64 start = stat_start();
+  int contended = 0;
+
+  node->next = 0;
+  node->locked = 1;
+
+  // amoswap.d.aqrl appends us to the queue of waiters
+  mcs_node *prev = __atomic_exchange_n(&l->tail, node, __ATOMIC_ACQ_REL);
+  if (prev != 0) {
+    // our predecessor clears node->locked when it releases the lock
+    contended = 1;
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+      if (poll)
+        poll();
+  }
+  l->holder = node;
+  l->intr = intr;
+  stat_acquired(&l->stat, start, contended);
+}
+
+void mcs_release(mcslock *l) {
+  mcs_node *node = l->holder;
+  uint64 intr = l->intr;
+
+  stat_release(&l->stat);
+  if (__atomic_load_n(&node->next, __ATOMIC_ACQUIRE) == 0) {
+    // nobody queued behind us: free the lock, unless a waiter is just
+    // appending itself (compiles to an lr.d/sc.d loop)
+    mcs_node *expected = node;
+    if (__atomic_compare_exchange_n(&l->tail, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      intr_restore(intr);
+      return;
+    }
+    while (__atomic_load_n(&node->next, __ATOMIC_ACQUIRE) == 0)
+      ;
+  }
+  __atomic_store_n(&node->next->locked, 0, __ATOMIC_RELEASE);
+  intr_restore(intr);
+}
+
+void lockstat_print(char *name, lockstat *s) {
+  printastring(name);
+  printastring(": acquired "); printhex(s->acquired);
+  printastring(" contended "); printhex(s->contended);
+  printastring(" spin "); printhex(s->spin);
+  printastring(" maxhold "); printhex(s->maxhold);
+  printastring("\n");
+}
@@ -0,0 +1,49 @@
+// Spinlocks for the kernel, built on the RISC-V atomics (AMO and LR/SC).
+// Both kinds turn machine interrupts off while held, so an interrupt on the
+// hart that holds a lock can never spin on it. Compile with -DLOCKSTAT to
+// make every lock collect the counters in lockstat.
+
+typedef struct {
+  uint64 acquired;  // number of acquisitions
+  uint64 contended; // acquisitions that had to spin
+  uint64 spin;      // mcycle cycles spent spinning
+  uint64 maxhold;   // longest time the lock was held, in mcycle cycles
+  uint64 since;     // mcycle at which the current holder got the lock
+} lockstat;
+
+// ticket lock: harts are served strictly in the order they arrived.
+// For locks that are taken often but held briefly by few harts.
+typedef struct {
+  volatile uint32 next;  // next ticket to hand out
+  volatile uint32 owner; // ticket being served
+  uint64 intr;           // holder's machine interrupt enable
+  char *name;
+  lockstat stat;
+} ticketlock;
+
+// MCS queue lock: every waiter spins on its own node instead of the shared
+// lock word, so contention does not bounce one cache line between all harts.
+// For heavily contended structures.
+typedef struct mcs_node {
+  struct mcs_node *volatile next;
+  volatile int locked;
+} mcs_node;
+
+typedef struct {
+  mcs_node *volatile tail; // last waiter, 0 if the lock is free
+  mcs_node *holder;        // node of the current holder
+  uint64 intr;             // holder's machine interrupt enable
+  char *name;
+  lockstat stat;
+} mcslock;
+
+#define TICKETLOCK_INIT(n) { 0, 0, 0, n }
+#define MCSLOCK_INIT(n) { 0, 0, 0, n }
+
+void ticket_acquire(ticketlock *l);
+void ticket_acquire_poll(ticketlock *l, void (*poll)(void));
+void ticket_release(ticketlock *l);
+void mcs_acquire(mcslock *l, mcs_node *node);
+void mcs_acquire_poll(mcslock *l, mcs_node *node, void (*poll)(void));
+void mcs_release(mcslock *l);
+void lockstat_print(char *name, lockstat *s);
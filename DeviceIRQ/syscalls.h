@@ -1,2 +1,9 @@
-enum { PRINTASTRING = 1, PUTACHAR, GETACHAR, SLEEP, YIELD = 23, EXIT = 42 };
+enum { PRINTASTRING = 1, PUTACHAR, GETACHAR, SLEEP, SETSLACK, ITIMERSET, ITIMERREAD, ITIMERWAIT,
+       GROUPCREATE, GROUPATTACH, GROUPUSAGE, SETSCHED, SCHEDSTATS, LOCKSTATS, VMSTATS, IRQAFFINITY, IRQSTATS, SETAFFINITY, GETAFFINITY, SETNODE, PROCINFO, FALSESHARE, YIELD = 23, SETTHP, FORK,
+       SHMGET, SHMMAP, SHMUNMAP, SHMREMOVE, BRK, MMAP, MUNMAP, EXIT = 42 };
+
+// access for MMAP and SHMMAP
+enum { PROT_READ = 1, PROT_WRITE = 2 };
+#define SHM_READ PROT_READ
+#define SHM_WRITE PROT_WRITE
 
@@ -0,0 +1,136 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// TLB shootdowns. Address spaces are tagged with ASID pid+1, so their TLB
+// entries survive switches and a hart that once ran a process may still hold
+// translations for it (pcbentry.tlb_harts). Whoever changes or removes a
+// mapping queues the page with tlb_invalidate() and sends the batch with
+// tlb_flush(): one IPI per hart in tlb_harts, however many pages changed.
+// A hart with too few ASID bits for MAXPROCS processes flushes its whole
+// TLB on every switch instead, see tlb_hart_init().
+
+extern void printastring(char *);
+extern void printhex(uint64);
+
+extern pcbentry pcb[MAXPROCS];
+extern cpu cpus[NCPU];
+
+// find out how many ASID bits this hart has: write ones to all of them and
+// read back the ones that stuck. Unless pid+1 fits for every process,
+// return_to_user flushes the TLB on each switch.
+void tlb_hart_init(void) {
+  uint64 asids;
+
+  w_satp(SATP_SV39 | SATP_ASID(0xffff));
+  asids = (r_satp() >> 44) & 0xffff;
+  w_satp(0);
+  mycpu()->asid_flush = asids < MAXPROCS;
+}
+
+// flush the pages in req from this hart's TLB
+static void tlb_apply(int pid, tlbreq *req) {
+  uint64 asid = pid + 1;
+
+  if (req->n > TLB_BATCH) {
+    asm volatile("sfence.vma zero, %0" : : "r" (asid));
+    mycpu()->tlb_full++;
+    // nothing of the address space is left here unless it runs here
+    if (mycpu()->pid != pid)
+      __atomic_fetch_and(&pcb[pid].tlb_harts, ~(1ULL << mycpu()->hartid), __ATOMIC_RELAXED);
+  } else {
+    for (int i=0; i<req->n; i++)
+      asm volatile("sfence.vma %0, %1" : : "r" (req->va[i]), "r" (asid));
+    mycpu()->tlb_pages += req->n;
+  }
+  req->n = 0;
+}
+
+// queue page va of pid's address space for invalidation. Too many pages
+// turn into a flush of the whole address space.
+void tlb_invalidate(int pid, uint64 va) {
+  tlbreq *b = &pcb[pid].tlb_batch;
+
+  if (b->n < TLB_BATCH)
+    b->va[b->n] = va & ~0xfffULL;
+  if (b->n <= TLB_BATCH)
+    b->n++;
+}
+
+// the whole address space of pid changes, e.g. a new program replaces it
+void tlb_invalidate_all(int pid) {
+  pcb[pid].tlb_batch.n = TLB_BATCH + 1;
+}
+
+// send pid's queued invalidations to every hart that may cache its
+// translations and wait until they are gone everywhere, so the old frames
+// can be reused. Called with the kernel lock held.
+void tlb_flush(int pid) {
+  tlbreq *b = &pcb[pid].tlb_batch;
+  uint64 seq[NCPU];
+  uint64 targets = 0;
+
+  if (b->n == 0)
+    return;
+  for (int h=0; h<NCPU; h++) {
+    if (!(pcb[pid].tlb_harts & (1ULL << h)) || h == mycpu()->hartid)
+      continue;
+    cpu *c = &cpus[h];
+    tlbreq *req = &c->tlb_reqs[pid];
+
+    ticket_acquire(&c->tlb_lock);
+    if (req->n + b->n > TLB_BATCH) {
+      req->n = TLB_BATCH + 1;
+    } else {
+      for (int i=0; i<b->n; i++)
+        req->va[req->n++] = b->va[i];
+    }
+    seq[h] = ++c->tlb_seq;
+    ticket_release(&c->tlb_lock);
+
+    ipi_send(h, IPI_TLBFLUSH);
+    mycpu()->tlb_ipis++;
+    targets |= 1ULL << h;
+  }
+  if (pcb[pid].tlb_harts & (1ULL << mycpu()->hartid))
+    tlb_apply(pid, b);
+  b->n = 0;
+
+  for (int h=0; h<NCPU; h++) {
+    if (targets & (1ULL << h))
+      while (__atomic_load_n(&cpus[h].tlb_done, __ATOMIC_ACQUIRE) < seq[h])
+        ;
+  }
+}
+
+// serve the invalidations other harts queued for this one. Runs without the
+// kernel lock: from ipi_receive and while we spin for the kernel lock, as
+// its holder may be waiting for us in tlb_flush.
+void tlb_poll(void) {
+  cpu *c = mycpu();
+
+  if (__atomic_load_n(&c->tlb_done, __ATOMIC_ACQUIRE) == c->tlb_seq)
+    return;
+  ticket_acquire(&c->tlb_lock);
+  for (int pid=0; pid<MAXPROCS; pid++) {
+    if (c->tlb_reqs[pid].n != 0)
+      tlb_apply(pid, &c->tlb_reqs[pid]);
+  }
+  __atomic_store_n(&c->tlb_done, c->tlb_seq, __ATOMIC_RELEASE);
+  ticket_release(&c->tlb_lock);
+}
+
+void tlb_stats(void) {
+  for (int h=0; h<NCPU; h++) {
+    if (!cpus[h].online)
+      continue;
+    printastring("hart "); printhex(h);
+    printastring(" tlb ipis sent "); printhex(cpus[h].tlb_ipis);
+    printastring(" pages flushed "); printhex(cpus[h].tlb_pages);
+    printastring(" full flushes "); printhex(cpus[h].tlb_full);
+    printastring(" flush on switch "); printhex(cpus[h].asid_flush);
+    printastring("\n");
+  }
+}
@@ -0,0 +1,59 @@
+#include "types.h"
+#include "syscalls.h"
+
+extern uint64 syscall(uint64 nr, uint64 param, uint64 param2, uint64 param3);
+extern void printastring(char *s);
+extern void printhex(uint64 x);
+extern uint64 rdtime(void);
+
+// TLB reach microbenchmark. Two arrays of the same size are touched page
+// by page, the first with huge pages switched off, so it stays in 4 KB
+// pages, the second with them on, so the kernel collapses every 2 MB of it
+// into a megapage once all of its pages are in. Then the same random walk,
+// one load per page, runs over each array and prints the mtime ticks it
+// took; the VMSTATS dump at the end shows the promotions.
+
+#define HUGE 0x200000
+#define SIZE (4 * HUGE)
+#define PAGES (SIZE / 4096)
+#define LOADS (1 << 20)
+#define ROUNDS 4
+
+char small[SIZE] __attribute__((aligned(HUGE)));
+char big[SIZE] __attribute__((aligned(HUGE)));
+
+void touch(char *a) {
+    for (int p = 0; p < PAGES; p++)
+      a[p * 4096] = 1;
+}
+
+uint64 walk(char *a) {
+    volatile char *v = a;
+    uint64 x = 1, start = rdtime();
+
+    for (int i = 0; i < LOADS; i++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      (void)v[((x >> 33) % PAGES) * 4096 + (x & 0xff8)];
+    }
+    return rdtime() - start;
+}
+
+int main(void) {
+    syscall(SETTHP, 0, 0, 0);
+    touch(small);
+    syscall(SETTHP, 1, 0, 0);
+    touch(big);
+
+    for (int r = 0; r < ROUNDS; r++) {
+      uint64 t4k = walk(small);
+      uint64 t2m = walk(big);
+      printastring("tlbbench: 4k pages ");
+      printhex(t4k);
+      printastring(" 2m pages ");
+      printhex(t2m);
+      printastring("\n");
+    }
+    syscall(VMSTATS, 0, 0, 0);
+    syscall(EXIT, 0, 0, 0);
+    return 0;
+}
@@ -1,3 +1,4 @@
 typedef unsigned char uint8_t;
+typedef unsigned short uint16;
 typedef unsigned int uint32;
 typedef unsigned long long int uint64;
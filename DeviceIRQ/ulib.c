@@ -0,0 +1,44 @@
+#include "types.h"
+#include "syscalls.h"
+
+// What the benchmarks share: the system call stub, printing and the clock.
+// tlbbench, forkbench, shmbench and heapbench link it in.
+
+uint64 syscall(uint64 nr, uint64 param, uint64 param2, uint64 param3) {
+    // the kernel takes the number in a7 and the parameters in a0..a2, and
+    // returns in a0. One asm statement, so that the compiler cannot move
+    // anything between loading the registers and the ecall; "memory"
+    // because the kernel reads and writes our buffers.
+    register uint64 a0 asm("a0") = param;
+    register uint64 a1 asm("a1") = param2;
+    register uint64 a2 asm("a2") = param3;
+    register uint64 a7 asm("a7") = nr;
+
+    // here's our ecall!
+    asm volatile("ecall" : "+r" (a0) : "r" (a1), "r" (a2), "r" (a7) : "memory");
+    return a0;
+}
+
+void printastring(char *s) {
+    syscall(PRINTASTRING, (uint64)s, 0, 0);
+}
+
+void printhex(uint64 x) {
+    char s[19];
+
+    s[0] = '0';
+    s[1] = 'x';
+    for (int i = 0; i < 16; i++) {
+      int d = (x >> (60 - 4*i)) & 0xf;
+      s[2+i] = d < 10 ? d + '0' : d - 10 + 'a';
+    }
+    s[18] = 0;
+    printastring(s);
+}
+
+uint64 rdtime(void) {
+    uint64 t;
+
+    asm volatile("rdtime %0" : "=r" (t));
+    return t;
+}
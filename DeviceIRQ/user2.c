@@ -1,8 +1,6 @@
 #include "types.h"
 #include "syscalls.h"
 
-__attribute__ ((aligned (16))) char userstack[4096];
-
 uint64 syscall(uint64 nr, uint64 param) {
     uint64 retval;
 
@@ -0,0 +1,949 @@
+#include "types.h"
+#include "riscv.h"
+#include "hardware.h"
+#include "spinlock.h"
+#include "kernel.h"
+#include "syscalls.h"
+
+// Process address spaces: three-level Sv39 page tables with 4 KB pages,
+// built from the page table cache of the process' NUMA node. A process has
+//   [0, textend)                         text and rodata, read-only and executable
+//   [textend, sz)                        data, bss and the heap BRK grows, read/write
+//   [USTACK_TOP - USTACK_SIZE, USTACK_TOP) its stack, read/write
+// The loader maps the pages of the program image; bss, heap and stack pages
+// are only allocated when the process first touches them (vm_fault).
+// MMAP reserves anonymous memory the same way: as a vma (see below) whose
+// pages are filled in on first touch.
+// Once all 512 pages of an aligned 2 MB range inside one region are mapped,
+// they are collapsed into one megapage (vm_promote), which takes one TLB
+// entry instead of 512; vm_demote splits it again. Below that, if all harts
+// implement Svnapot, every aligned 64 KB of 16 mapped pages with the same
+// permissions is moved into one 64 KB block whose 16 PTEs carry PTE_N, so
+// they share one TLB entry as well. The frames of such a block are single
+// pages to the allocator.
+//
+// FORK shares every page of the parent with the child. Writable pages turn
+// read-only with PTE_COW in both; the first store to one copies it
+// (cow_fault), unless nobody else maps it any more. pageinfo.refs counts the
+// page tables a page is in.
+//
+// Other regions, anonymous or shared memory, are vmas. Each process keeps
+// pointers to them in a block of pages of its own, sorted by address, so a
+// fault finds the vma of its address with a binary search; a full block is
+// replaced by one twice the size. VMSTATS reads the arrays without the
+// kernel lock, so vmas and the arrays are freed through RCU and every
+// change stores whole pointers. The pages of shared memory carry PTE_SHARED and are
+// never copied: not on FORK and not to collapse them into larger pages.
+
+extern void printastring(char *);
+extern void printhex(uint64);
+extern void putachar(char c);
+extern cpu cpus[NCPU];
+
+extern pcbentry pcb[MAXPROCS];
+extern int nnodes;
+
+uint64 thp_promotions, thp_demotions, thp_failed;
+uint64 napot_promotions, napot_splits, napot_failed;
+uint64 cow_copies, cow_reuses;
+
+kmem_cache vma_cache = KMEM_CACHE_INIT("vma", sizeof(vma), 0);
+
+static void vma_free(void *v) {
+  kmem_free(&vma_cache, v);
+}
+
+static void vmas_free(void *vmas) {
+  page_free((uint64)vmas);
+}
+
+// page tables come from a cache per node, whose slabs are all on that node.
+// They are handed out zeroed: the constructor clears them once, and
+// pt_free clears them again before they go back, right after free_table or
+// huge_promote walked them, while they are still in the data cache.
+kmem_cache pt_cache[NNODE];
+
+static void pt_zero(void *pt) {
+  for (int i=0; i<512; i++)
+    ((uint64 *)pt)[i] = 0;
+}
+
+void pt_init(void) {
+  for (int n=0; n<NNODE; n++) {
+    pt_cache[n] = (kmem_cache)KMEM_CACHE_INIT("pagetable", PGSIZE, pt_zero);
+    pt_cache[n].node = n;
+  }
+}
+
+// a zeroed page table on node, or the first of the other nodes that has
+// one. returns 0 if there is no memory.
+static uint64 *pt_alloc(int node) {
+  uint64 *pt = 0;
+
+  for (int k=0; k<nnodes && pt == 0; k++)
+    pt = kmem_alloc(&pt_cache[(node + k) % nnodes]);
+  return pt;
+}
+
+static void pt_free(uint64 *pt) {
+  pt_zero(pt);
+  kmem_free(&pt_cache[frame_node((uint64)pt)], pt);
+}
+
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
+
+// return the address of the PTE for va in pagetable: of the 4 KB page, or
+// of the megapage va is in. If alloc is set, page table pages that are
+// missing on the way are allocated on node. returns 0 if va is not mapped
+// and nothing was allocated.
+uint64 *walk(uint64 pagetable, uint64 va, int alloc, int node) {
+  uint64 *pt = (uint64 *)pagetable;
+
+  for (int level = 2; level > 0; level--) {
+    uint64 *pte = &pt[PX(level, va)];
+    if ((*pte & PTE_V) && PTE_LEAF(*pte)) {
+      return pte;
+    } else if (*pte & PTE_V) {
+      pt = (uint64 *)PTE2PA(*pte);
+    } else {
+      if (!alloc || (pt = pt_alloc(node)) == 0)
+        return 0;
+      *pte = PA2PTE(pt) | PTE_V;
+    }
+  }
+  return &pt[PX(0, va)];
+}
+
+// physical address of the 4 KB page va is in, of the level 0 PTE pte.
+// The PPN of a Svnapot PTE is that of its 64 KB block, with 0b1000 in the
+// low four bits.
+static uint64 pte_pa(uint64 pte, uint64 va) {
+  if (pte & PTE_N)
+    return (PTE2PA(pte) & ~(NAPOTSIZE - 1)) | (va & (NAPOTSIZE - 1) & ~(PGSIZE - 1));
+  return PTE2PA(pte);
+}
+
+// level 1 PTE of the 2 MB range va is in, 0 if there is no level 1 table
+static uint64 *walk_l1(uint64 pagetable, uint64 va) {
+  uint64 *root = (uint64 *)pagetable;
+
+  if (!(root[PX(2, va)] & PTE_V))
+    return 0;
+  return &((uint64 *)PTE2PA(root[PX(2, va)]))[PX(1, va)];
+}
+
+// map the page at va of pid's address space to pa. returns 0 or -1 if
+// there is no memory for the page table.
+int map_page(int pid, uint64 va, uint64 pa, uint64 perm) {
+  uint64 *l1 = walk_l1(pcb[pid].pagetablebase, va);
+  uint64 *pte;
+
+  // a single page inside a megapage: split it first
+  if (l1 && (*l1 & PTE_V) && PTE_LEAF(*l1) && vm_demote(pid, va) < 0)
+    return -1;
+  pte = walk(pcb[pid].pagetablebase, va, 1, proc_node(pid));
+  if (pte == 0)
+    return -1;
+  if (*pte & PTE_N)
+    napot_split(pid, va);
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
+// give pid an empty address space. returns 0 or -1.
+int uvm_create(int pid) {
+  uint64 root = (uint64)pt_alloc(proc_node(pid));
+
+  if (root == 0)
+    return -1;
+  pcb[pid].pagetablebase = root;
+  pcb[pid].satp = MAKE_SATP(root) | SATP_ASID(pid + 1);
+  pcb[pid].sz = 0;
+  pcb[pid].vmas = 0;
+  pcb[pid].nvma = 0;
+  pcb[pid].maxvma = 0;
+  return 0;
+}
+
+// index of the first vma of pid that ends above va, nvma if there is none
+static int vma_search(int pid, uint64 va) {
+  int lo = 0, hi = pcb[pid].nvma;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (pcb[pid].vmas[mid]->end <= va)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// the vma of pid va is in, 0 if none
+vma *vma_find(int pid, uint64 va) {
+  int i = vma_search(pid, va);
+
+  if (i < pcb[pid].nvma && pcb[pid].vmas[i]->start <= va)
+    return pcb[pid].vmas[i];
+  return 0;
+}
+
+// does [start, end) overlap text, data or stack of pid?
+static int fixed_overlap(int pid, uint64 start, uint64 end) {
+  return start < PGROUNDUP(pcb[pid].sz) || end > USTACK_TOP - USTACK_SIZE;
+}
+
+// make room for one more vma in pid's array: the first one is a page, a
+// full one is copied into a block twice the size. Readers may still walk
+// the old one, it is freed through RCU. returns 0 or -1 if there is no
+// memory.
+static int vma_reserve(int pid) {
+  int order = 0;
+  vma **vmas;
+
+  if (pcb[pid].nvma < pcb[pid].maxvma)
+    return 0;
+  while ((PGSIZE << order) / sizeof(vma *) <= pcb[pid].maxvma)
+    order++;
+  if (order > MAXORDER || (vmas = (vma **)page_alloc(order, proc_node(pid))) == 0)
+    return -1;
+  for (int i=0; i<pcb[pid].nvma; i++)
+    vmas[i] = pcb[pid].vmas[i];
+  if (pcb[pid].vmas)
+    rcu_call(vmas_free, pcb[pid].vmas);
+  // the release store orders the copied entries before the new pointer
+  __atomic_store_n(&pcb[pid].vmas, vmas, __ATOMIC_RELEASE);
+  pcb[pid].maxvma = (PGSIZE << order) / sizeof(vma *);
+  return 0;
+}
+
+// put v at index i of pid's array, which has room for it
+static void vma_link(int pid, int i, vma *v) {
+  vma **vmas = pcb[pid].vmas;
+
+  for (int j = pcb[pid].nvma; j > i; j--)
+    vmas[j] = vmas[j - 1];
+  vmas[i] = v;
+  __atomic_store_n(&pcb[pid].nvma, pcb[pid].nvma + 1, __ATOMIC_RELEASE);
+}
+
+// add the region [start, end) to pid. returns it, or 0 if it overlaps
+// another region or there is no memory.
+vma *vma_insert(int pid, uint64 start, uint64 end, uint64 perm, shmseg *seg) {
+  int i = vma_search(pid, start);
+  vma *v;
+
+  if (start >= end || fixed_overlap(pid, start, end))
+    return 0;
+  if (i < pcb[pid].nvma && pcb[pid].vmas[i]->start < end)
+    return 0;
+  if (vma_reserve(pid) < 0 || (v = kmem_alloc(&vma_cache)) == 0)
+    return 0;
+  v->start = start;
+  v->end = end;
+  v->perm = perm;
+  v->seg = seg;
+  vma_link(pid, i, v);
+  return v;
+}
+
+// drop v from pid's array. Its pages have to be unmapped already.
+void vma_remove(int pid, vma *v) {
+  vma **vmas = pcb[pid].vmas;
+
+  for (int i = vma_search(pid, v->start) + 1; i < pcb[pid].nvma; i++)
+    vmas[i - 1] = vmas[i];
+  __atomic_store_n(&pcb[pid].nvma, pcb[pid].nvma - 1, __ATOMIC_RELEASE);
+  rcu_call(vma_free, v);
+}
+
+// the lowest free range of size bytes from MMAP_BASE, or the break if that
+// has grown past it, on, aligned to align. returns its start, 0 if there is
+// none below the stack.
+uint64 vma_gap(int pid, uint64 size, uint64 align) {
+  uint64 va = MMAP_BASE;
+
+  if (PGROUNDUP(pcb[pid].sz) > va)
+    va = PGROUNDUP(pcb[pid].sz);
+
+  for (int i=0; i<pcb[pid].nvma; i++) {
+    vma *v = pcb[pid].vmas[i];
+    va = (va + align - 1) & ~(align - 1);
+    if (v->end <= va)
+      continue;
+    if (va + size <= v->start)
+      break;
+    va = v->end;
+  }
+  va = (va + align - 1) & ~(align - 1);
+  return fixed_overlap(pid, va, va + size) ? 0 : va;
+}
+
+// the region of pid va is in: its permissions, and its bounds in *start and
+// *end. returns 0 if va is in none of them.
+static uint64 region_of(int pid, uint64 va, uint64 *start, uint64 *end) {
+  if (va < pcb[pid].textend) {
+    *start = 0;
+    *end = pcb[pid].textend;
+    return PTE_R | PTE_X | PTE_U;
+  }
+  if (va < pcb[pid].sz) {
+    *start = pcb[pid].textend;
+    *end = pcb[pid].sz;
+    return PTE_R | PTE_W | PTE_U;
+  }
+  if (va >= USTACK_TOP - USTACK_SIZE && va < USTACK_TOP) {
+    *start = USTACK_TOP - USTACK_SIZE;
+    *end = USTACK_TOP;
+    return PTE_R | PTE_W | PTE_U;
+  }
+  vma *v = vma_find(pid, va);
+  if (v) {
+    *start = v->start;
+    *end = v->end;
+    return v->perm;
+  }
+  return 0;
+}
+
+// the permissions of the page at va of pid, 0 if va is in none of its regions
+static uint64 region_perm(int pid, uint64 va) {
+  uint64 start, end;
+
+  return region_of(pid, va, &start, &end);
+}
+
+// map a zeroed page at va of pid. The accessed and dirty bits are set right
+// away, we do not use them. returns 0 or -1 if we ran out of memory.
+int uvm_alloc_page(int pid, uint64 va, uint64 perm) {
+  uint64 pa = frame_alloc(proc_node(pid));
+
+  if (pa == 0)
+    return -1;
+  if (map_page(pid, va, pa, perm | PTE_A | PTE_D) < 0) {
+    frame_free(pa);
+    return -1;
+  }
+  pcb[pid].rss++;
+  return 0;
+}
+
+// a store to the page at va that pid shares copy-on-write: give it a copy of
+// its own, or just the write permission back if nobody else maps the page
+// any more. returns 0 or -1 if there is no memory for the copy.
+static int cow_fault(int pid, uint64 va, uint64 *pte) {
+  uint64 pa, copy;
+
+  if (*pte & PTE_N)
+    napot_split(pid, va);
+  pa = PTE2PA(*pte);
+  if (page_info(pa)->refs > 1) {
+    copy = frame_alloc(proc_node(pid));
+    if (copy == 0)
+      return -1;
+    for (int k=0; k<PGSIZE/8; k++)
+      ((uint64 *)copy)[k] = ((uint64 *)pa)[k];
+    frame_put(pa);
+    pa = copy;
+    cow_copies++;
+  } else {
+    cow_reuses++;
+  }
+  *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  tlb_invalidate(pid, va);
+  tlb_flush(pid);
+  return 0;
+}
+
+// a page fault (cause 12 = fetch, 13 = load, 15 = store) of pid at va. If
+// va is in one of its regions, allows the access and is not mapped yet, map
+// a zeroed page; a store to a copy-on-write page copies it. Either way the
+// instruction can be retried. returns 0 if so, -1 if the access is invalid.
+int vm_fault(int pid, uint64 va, uint64 cause) {
+  uint64 perm = region_perm(pid, va);
+  uint64 *pte;
+
+  if (perm == 0 || (cause == 12 && !(perm & PTE_X)) || (cause == 15 && !(perm & PTE_W)))
+    goto bad;
+  vma *v = vma_find(pid, va);
+  if (v && v->seg)
+    goto bad; // shared memory is mapped in full, not on demand
+  va = PGROUNDDOWN(va);
+  pte = walk(pcb[pid].pagetablebase, va, 0, 0);
+  if (pte && (*pte & PTE_V)) {
+    if (cause == 15 && (*pte & PTE_COW) && cow_fault(pid, va, pte) == 0) {
+      mycpu()->faults++;
+      return 0;
+    }
+    goto bad; // mapped, but not for this kind of access
+  }
+  if (uvm_alloc_page(pid, va, perm) < 0)
+    goto bad;
+  mycpu()->faults++;
+  vm_promote(pid, va);
+  return 0;
+
+bad:
+  mycpu()->badfaults++;
+  return -1;
+}
+
+// ---- transparent huge pages ----
+
+// the 16 PTEs of the 64 KB block the page at va of pid is in, 0 if the
+// range is not mapped by level 0 PTEs
+static uint64 *napot_ptes(int pid, uint64 va) {
+  uint64 *l1 = walk_l1(pcb[pid].pagetablebase, va);
+
+  if (l1 == 0 || !(*l1 & PTE_V) || PTE_LEAF(*l1))
+    return 0;
+  return &((uint64 *)PTE2PA(*l1))[PX(0, va) & ~15];
+}
+
+// move the 64 KB around va of pid into one Svnapot block if its 16 pages
+// are mapped with the same permissions. returns 1 if it did.
+static int napot_promote(int pid, uint64 va) {
+  uint64 base = va & ~(NAPOTSIZE - 1);
+  uint64 *pte = napot_ptes(pid, base);
+  uint64 block, flags, old[16];
+
+  if (!boot.svnapot || pcb[pid].nothp || pte == 0 || (pte[0] & PTE_N))
+    return 0;
+  flags = PTE_FLAGS(pte[0]);
+  if (flags & (PTE_COW | PTE_SHARED))
+    return 0; // shared pages stay where they are
+  for (int i=0; i<16; i++)
+    if (!(pte[i] & PTE_V) || PTE_FLAGS(pte[i]) != flags)
+      return 0;
+
+  block = page_alloc(NAPOTORDER, proc_node(pid));
+  if (block == 0) {
+    napot_failed++;
+    return 0;
+  }
+  page_split(block);
+  for (int i=0; i<16; i++) {
+    old[i] = PTE2PA(pte[i]);
+    for (int k=0; k<PGSIZE/8; k++)
+      ((uint64 *)(block + i * PGSIZE))[k] = ((uint64 *)old[i])[k];
+    pte[i] = PA2PTE(block + 8 * PGSIZE) | flags | PTE_N;
+  }
+
+  // nobody may use the old pages before they are freed
+  tlb_invalidate_all(pid);
+  tlb_flush(pid);
+  for (int i=0; i<16; i++)
+    frame_put(old[i]);
+  napot_promotions++;
+  return 1;
+}
+
+// turn the Svnapot block the page at va of pid is in back into 16 PTEs of
+// their own, e.g. because one of them is about to be replaced
+void napot_split(int pid, uint64 va) {
+  uint64 base = va & ~(NAPOTSIZE - 1);
+  uint64 *pte = napot_ptes(pid, base);
+
+  if (pte == 0 || !(pte[0] & PTE_N))
+    return;
+  for (int i=0; i<16; i++)
+    pte[i] = PA2PTE(pte_pa(pte[i], base + i * PGSIZE)) | PTE_FLAGS(pte[i]);
+  tlb_invalidate_all(pid);
+  tlb_flush(pid);
+  napot_splits++;
+}
+
+// collapse the 2 MB range around va of pid into a megapage if all its 512
+// pages are mapped, it lies within one region and the process did not turn
+// huge pages off. The pages are copied into a 2 MB block; if there is none,
+// the range stays as it is. returns 1 if it was promoted.
+static int huge_promote(int pid, uint64 va) {
+  uint64 base = va & ~(HUGEPGSIZE - 1);
+  uint64 start, end, perm;
+  uint64 *l1, *l0, huge;
+
+  if (pcb[pid].nothp)
+    return 0;
+  perm = region_of(pid, base, &start, &end);
+  if (perm == 0 || base < start || base + HUGEPGSIZE > end)
+    return 0;
+  l1 = walk_l1(pcb[pid].pagetablebase, base);
+  if (l1 == 0 || !(*l1 & PTE_V) || PTE_LEAF(*l1))
+    return 0;
+  l0 = (uint64 *)PTE2PA(*l1);
+  for (int i=0; i<512; i++)
+    if (!(l0[i] & PTE_V) || (l0[i] & PTE_SHARED))
+      return 0;
+
+  huge = page_alloc(HUGEORDER, proc_node(pid));
+  if (huge == 0) {
+    thp_failed++;
+    return 0;
+  }
+  for (int i=0; i<512; i++) {
+    uint64 *src = (uint64 *)pte_pa(l0[i], base + i * PGSIZE);
+    uint64 *dst = (uint64 *)(huge + i * PGSIZE);
+    for (int k=0; k<PGSIZE/8; k++)
+      dst[k] = src[k];
+  }
+  *l1 = PA2PTE(huge) | perm | PTE_A | PTE_D | PTE_V;
+
+  // nobody may use the old pages before they are freed
+  tlb_invalidate_all(pid);
+  tlb_flush(pid);
+  for (int i=0; i<512; i++)
+    frame_put(pte_pa(l0[i], base + i * PGSIZE));
+  pt_free(l0);
+  thp_promotions++;
+  return 1;
+}
+
+// collapse what can be collapsed around va of pid: its 64 KB block, then its
+// 2 MB range. returns 1 if either was promoted.
+int vm_promote(int pid, uint64 va) {
+  int napot = napot_promote(pid, va);
+
+  return huge_promote(pid, va) || napot;
+}
+
+// split the megapage va of pid is in into 512 pages again, e.g. because only
+// part of it is unmapped or changes permissions. returns 0 (also if there is
+// no megapage) or -1 if there is no memory for the page table.
+int vm_demote(int pid, uint64 va) {
+  uint64 *l1 = walk_l1(pcb[pid].pagetablebase, va);
+  uint64 *l0, huge, flags;
+
+  if (l1 == 0 || !(*l1 & PTE_V) || !PTE_LEAF(*l1))
+    return 0;
+  l0 = pt_alloc(proc_node(pid));
+  if (l0 == 0)
+    return -1;
+  huge = PTE2PA(*l1);
+  flags = PTE_FLAGS(*l1);
+  page_split(huge);
+  // the 2 MB block is made of aligned 64 KB blocks, keep those
+  for (int i=0; i<512; i++) {
+    if (boot.svnapot && !pcb[pid].nothp)
+      l0[i] = PA2PTE(huge + (i & ~15) * PGSIZE + 8 * PGSIZE) | flags | PTE_N;
+    else
+      l0[i] = PA2PTE(huge + i * PGSIZE) | flags;
+  }
+  *l1 = PA2PTE(l0) | PTE_V;
+  tlb_invalidate_all(pid);
+  tlb_flush(pid);
+  thp_demotions++;
+  return 0;
+}
+
+// split the megapages and 64 KB blocks of [start, end) of pid
+static void split_range(int pid, uint64 start, uint64 end) {
+  for (uint64 va = start & ~(HUGEPGSIZE - 1); va < end; va += HUGEPGSIZE)
+    vm_demote(pid, va);
+  for (uint64 va = start & ~(NAPOTSIZE - 1); va < end; va += NAPOTSIZE)
+    napot_split(pid, va);
+}
+
+// SETTHP syscall: allow (1) or forbid (0) huge pages for pid. Forbidding
+// splits the megapages and 64 KB blocks it already has. returns the previous setting.
+int vm_set_thp(int pid, int on) {
+  int old = !pcb[pid].nothp;
+
+  pcb[pid].nothp = !on;
+  if (!on) {
+    split_range(pid, 0, pcb[pid].sz);
+    split_range(pid, USTACK_TOP - USTACK_SIZE, USTACK_TOP);
+    for (int i=0; i<pcb[pid].nvma; i++)
+      split_range(pid, pcb[pid].vmas[i]->start, pcb[pid].vmas[i]->end);
+  }
+  return old;
+}
+
+static void free_table(uint64 *pt, int level) {
+  for (int i=0; i<512; i++) {
+    if (!(pt[i] & PTE_V))
+      continue;
+    if (level == 1 && PTE_LEAF(pt[i]))
+      page_free(PTE2PA(pt[i])); // a megapage
+    else if (level > 0)
+      free_table((uint64 *)PTE2PA(pt[i]), level - 1);
+    else
+      frame_put(pte_pa(pt[i], (uint64)i * PGSIZE));
+  }
+  pt_free(pt);
+}
+
+// free pid's pages and page tables, once no hart's TLB holds translations
+// of them any more
+void uvm_free(int pid) {
+  vma **vmas = pcb[pid].vmas;
+  int n = pcb[pid].nvma;
+
+  if (pcb[pid].pagetablebase == 0)
+    return;
+  tlb_invalidate_all(pid);
+  tlb_flush(pid);
+  free_table((uint64 *)pcb[pid].pagetablebase, 2);
+  __atomic_store_n(&pcb[pid].nvma, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&pcb[pid].vmas, 0, __ATOMIC_RELEASE);
+  pcb[pid].maxvma = 0;
+  for (int i=0; i<n; i++) {
+    if (vmas[i]->seg)
+      shm_unref(vmas[i]->seg);
+    rcu_call(vma_free, vmas[i]);
+  }
+  if (vmas)
+    rcu_call(vmas_free, vmas);
+  pcb[pid].pagetablebase = 0;
+  pcb[pid].textend = 0;
+  pcb[pid].sz = 0;
+  pcb[pid].rss = 0;
+}
+
+// map the size bytes of shared memory at pa to va of pid, with PTE_SHARED.
+// Every 64 KB block that is aligned in both gets Svnapot PTEs. returns 0 or
+// -1 if there is no memory for the page tables; then nothing is mapped.
+int uvm_map_shared(int pid, uint64 va, uint64 pa, uint64 size, uint64 perm) {
+  int napot = boot.svnapot && !pcb[pid].nothp && ((va ^ pa) & (NAPOTSIZE - 1)) == 0;
+
+  perm |= PTE_A | PTE_D | PTE_SHARED;
+  for (uint64 off = 0; off < size; off += PGSIZE) {
+    if (map_page(pid, va + off, pa + off, perm) < 0) {
+      uvm_unmap(pid, va, off);
+      return -1;
+    }
+    frame_ref(pa + off);
+    pcb[pid].rss++;
+  }
+  if (!napot)
+    return 0;
+  for (uint64 off = (NAPOTSIZE - (va & (NAPOTSIZE - 1))) & (NAPOTSIZE - 1);
+       off + NAPOTSIZE <= size; off += NAPOTSIZE) {
+    uint64 *pte = walk(pcb[pid].pagetablebase, va + off, 0, 0);
+    for (int i=0; i<16; i++)
+      pte[i] = PA2PTE(pa + off + 8 * PGSIZE) | perm | PTE_V | PTE_N;
+  }
+  return 0;
+}
+
+// remove the pages of [va, va + size) from pid's page table, and drop its
+// references to them once no TLB holds them any more. returns 0, or -1 if
+// there is no memory to split a megapage; then nothing is unmapped.
+int uvm_unmap(int pid, uint64 va, uint64 size) {
+  uint64 put[TLB_BATCH];
+  uint64 start = va, end = va + size;
+
+  // megapages are split first, so that only their pages in the range go
+  for (uint64 a = va & ~(HUGEPGSIZE - 1); a < end; a += HUGEPGSIZE)
+    if (vm_demote(pid, a) < 0)
+      return -1;
+  while (va < end) {
+    int n = 0;
+
+    for (; va < end && n < TLB_BATCH; va += PGSIZE) {
+      uint64 *pte = walk(pcb[pid].pagetablebase, va, 0, 0);
+      uint64 block = va & ~(NAPOTSIZE - 1);
+
+      if (pte == 0 || !(*pte & PTE_V))
+        continue;
+      // as are 64 KB blocks
+      if ((*pte & PTE_N) && (block < start || block + NAPOTSIZE > end))
+        napot_split(pid, va);
+      put[n++] = pte_pa(*pte, va);
+      *pte = 0;
+      tlb_invalidate(pid, va);
+      pcb[pid].rss--;
+    }
+    tlb_flush(pid);
+    for (int i=0; i<n; i++)
+      frame_put(put[i]);
+  }
+  return 0;
+}
+
+// give child, whose pcb is set up, a copy-on-write copy of the address
+// space of parent. Megapages are split first, so that every shared page has
+// a PTE of its own in both. returns 0 or -1 if we ran out of memory.
+int uvm_fork(int parent, int child) {
+  uint64 *root = (uint64 *)pcb[parent].pagetablebase;
+
+  if (uvm_create(child) < 0)
+    return -1;
+  pcb[child].textend = pcb[parent].textend;
+  pcb[child].sz = pcb[parent].sz;
+  pcb[child].heap = pcb[parent].heap;
+  pcb[child].rss = pcb[parent].rss;
+  pcb[child].nothp = pcb[parent].nothp;
+  for (int i=0; i<pcb[parent].nvma; i++) {
+    vma *v = pcb[parent].vmas[i];
+    if (vma_insert(child, v->start, v->end, v->perm, v->seg) == 0)
+      goto fail;
+    if (v->seg)
+      v->seg->nmaps++;
+  }
+
+  for (int i=0; i<512; i++) {
+    if (!(root[i] & PTE_V))
+      continue;
+    uint64 *l1 = (uint64 *)PTE2PA(root[i]);
+    for (int j=0; j<512; j++) {
+      uint64 va = ((uint64)i << PXSHIFT(2)) | ((uint64)j << PXSHIFT(1));
+      if (!(l1[j] & PTE_V))
+        continue;
+      if (PTE_LEAF(l1[j]) && vm_demote(parent, va) < 0)
+        goto fail;
+      uint64 *l0 = (uint64 *)PTE2PA(l1[j]);
+      uint64 *c = walk(pcb[child].pagetablebase, va, 1, proc_node(child));
+      if (c == 0)
+        goto fail;
+      for (int k=0; k<512; k++) {
+        if (!(l0[k] & PTE_V))
+          continue;
+        if ((l0[k] & PTE_W) && !(l0[k] & PTE_SHARED))
+          l0[k] = (l0[k] & ~PTE_W) | PTE_COW;
+        c[k] = l0[k];
+        frame_ref(pte_pa(l0[k], va + k * PGSIZE));
+      }
+    }
+  }
+  // the parent's stores must fault from now on
+  tlb_invalidate_all(parent);
+  tlb_flush(parent);
+  return 0;
+
+fail:
+  tlb_invalidate_all(parent);
+  tlb_flush(parent);
+  uvm_free(child);
+  return -1;
+}
+
+// can pid store to va without a page fault?
+int user_writable(int pid, uint64 va) {
+  uint64 *pte;
+
+  if (pcb[pid].pagetablebase == 0)
+    return 0;
+  pte = walk(pcb[pid].pagetablebase, va, 0, 0);
+  return pte && (*pte & PTE_V) && (*pte & PTE_U) && (*pte & PTE_W);
+}
+
+// physical address of user address va of pid, 0 if it is not mapped
+uint64 user_addr(int pid, uint64 va) {
+  uint64 *pte, *l1;
+
+  if (pcb[pid].pagetablebase == 0)
+    return 0;
+  pte = walk(pcb[pid].pagetablebase, va, 0, 0);
+  if (pte == 0 || !(*pte & PTE_V) || !(*pte & PTE_U))
+    return 0;
+  l1 = walk_l1(pcb[pid].pagetablebase, va);
+  if (pte == l1)
+    return PTE2PA(*pte) + (va & (HUGEPGSIZE - 1));
+  return pte_pa(*pte, va) + (va & (PGSIZE - 1));
+}
+
+// copy n bytes from src to user address va of pid, page by page, as if
+// the process stored them itself. returns 0 or -1 if it could not.
+int copyout(int pid, uint64 va, void *src, uint64 n) {
+  char *s = src;
+
+  while (n > 0) {
+    uint64 pa = user_addr(pid, va);
+    uint64 chunk = PGSIZE - (va & (PGSIZE - 1));
+    if (pa == 0 || !user_writable(pid, va)) {
+      // not touched yet or shared copy-on-write, or not writable at all
+      if (vm_fault(pid, va, 15) < 0)
+        return -1;
+      pa = user_addr(pid, va);
+    }
+    if (chunk > n)
+      chunk = n;
+    for (uint64 i=0; i<chunk; i++)
+      ((char *)pa)[i] = s[i];
+    s += chunk;
+    va += chunk;
+    n -= chunk;
+  }
+  return 0;
+}
+
+// print the NUL terminated string at user address va of pid; it may cross
+// page boundaries. Stops at an unmapped page.
+void print_user_string(int pid, uint64 va) {
+  while (1) {
+    char *p = (char *)user_addr(pid, va);
+    if (p == 0)
+      return;
+    for (uint64 left = PGSIZE - (va & (PGSIZE - 1)); left > 0; left--) {
+      if (*p == 0)
+        return;
+      putachar(*p++);
+      va++;
+    }
+  }
+}
+
+// ---- heap and anonymous memory ----
+
+// BRK syscall: move the break of pid, the end of its heap, to brk; 0 just
+// asks for it. Growing only reserves the range, shrinking frees the pages
+// beyond the new break. returns the break, or -1 if brk is below the end
+// of bss, the heap would run into another region or there is no memory to
+// split a megapage.
+uint64 vm_brk(int pid, uint64 brk) {
+  uint64 old = pcb[pid].sz;
+
+  if (brk == 0)
+    return old;
+  if (brk < pcb[pid].heap || brk > USTACK_TOP - USTACK_SIZE)
+    return -1;
+  if (brk > old) {
+    int i = vma_search(pid, PGROUNDUP(old));
+    if (i < pcb[pid].nvma && pcb[pid].vmas[i]->start < PGROUNDUP(brk))
+      return -1;
+  } else if (PGROUNDUP(brk) < PGROUNDUP(old) &&
+             uvm_unmap(pid, PGROUNDUP(brk), PGROUNDUP(old) - PGROUNDUP(brk)) < 0) {
+    return -1;
+  }
+  pcb[pid].sz = brk;
+  return brk;
+}
+
+// MMAP syscall: reserve len bytes of anonymous, zero-filled memory for pid
+// at va, or where there is room if va is 0, readable and, with PROT_WRITE
+// in prot, writable. Its pages are allocated on first touch. The kernel
+// aligns ranges of 2 MB or more to 2 MB, so that they can get megapages.
+// returns the address, or -1 if va is not page aligned or in use.
+uint64 vm_mmap(int pid, uint64 va, uint64 len, uint64 prot) {
+  uint64 perm = PTE_R | PTE_U;
+
+  len = PGROUNDUP(len);
+  if (len == 0 || !(prot & (PROT_READ | PROT_WRITE)))
+    return -1;
+  if (prot & PROT_WRITE)
+    perm |= PTE_W;
+  if (va == 0) {
+    uint64 align = len >= HUGEPGSIZE ? HUGEPGSIZE : len >= NAPOTSIZE ? NAPOTSIZE : PGSIZE;
+    if ((va = vma_gap(pid, len, align)) == 0)
+      return -1;
+  } else if (va & (PGSIZE - 1)) {
+    return -1;
+  }
+  if (vma_insert(pid, va, va + len, perm, 0) == 0)
+    return -1;
+  return va;
+}
+
+// MUNMAP syscall: give back [va, va + len) of pid's anonymous memory. The
+// range may cover parts of vmas, which shrink or split, and unreserved
+// holes. returns 0, or -1 if it is not page aligned, overlaps shared
+// memory or a region that is not a vma, or we ran out of memory; then the
+// vmas and the page table are as they were.
+int vm_munmap(int pid, uint64 va, uint64 len) {
+  uint64 end = va + PGROUNDUP(len);
+  vma **vmas;
+  vma *tail = 0;
+  int i;
+
+  if ((va & (PGSIZE - 1)) || len == 0 || end < va || fixed_overlap(pid, va, end))
+    return -1;
+  i = vma_search(pid, va);
+  vmas = pcb[pid].vmas;
+  for (int j=i; j<pcb[pid].nvma && vmas[j]->start < end; j++)
+    if (vmas[j]->seg)
+      return -1;
+
+  // everything that can fail comes before the vmas change
+  if (i < pcb[pid].nvma && vmas[i]->start < va && vmas[i]->end > end) {
+    if (vma_reserve(pid) < 0 || (tail = kmem_alloc(&vma_cache)) == 0)
+      return -1;
+    vmas = pcb[pid].vmas;
+  }
+  if (uvm_unmap(pid, va, end - va) < 0) {
+    if (tail)
+      kmem_free(&vma_cache, tail);
+    return -1;
+  }
+
+  if (tail) {
+    // a hole in the middle: the part behind it becomes a vma of its own
+    vma *v = vmas[i];
+    tail->start = end;
+    tail->end = v->end;
+    tail->perm = v->perm;
+    tail->seg = 0;
+    v->end = va;
+    vma_link(pid, i + 1, tail);
+  } else {
+    while (i < pcb[pid].nvma && vmas[i]->start < end) {
+      vma *v = vmas[i];
+      if (v->start >= va && v->end <= end) {
+        vma_remove(pid, v);
+        continue;
+      }
+      if (v->start < va)
+        v->end = va;
+      else
+        v->start = end;
+      i++;
+    }
+  }
+  return 0;
+}
+
+// copy the NUL terminated string at user address va of pid to dst, at most
+// max bytes with the NUL. returns its length, or -1 if it is not mapped or
+// too long.
+int copyinstr(int pid, uint64 va, char *dst, int max) {
+  for (int i=0; i<max; i++, va++) {
+    char *p = (char *)user_addr(pid, va);
+    if (p == 0)
+      return -1;
+    if ((dst[i] = *p) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// VMSTATS, without the kernel lock in an RCU read-side section: a vma that
+// is being shrunk or split may show its old or its new bounds
+void vm_stats(void) {
+  for (int h=0; h<NCPU; h++) {
+    if (!cpus[h].online)
+      continue;
+    printastring("hart "); printhex(h);
+    printastring(" page faults "); printhex(cpus[h].faults);
+    printastring(" bad "); printhex(cpus[h].badfaults);
+    printastring("\n");
+  }
+  for (int i=0; i<MAXPROCS; i++) {
+    if (pcb[i].state == NONE)
+      continue;
+    printastring("pid "); printhex(i);
+    printastring(" resident pages "); printhex(pcb[i].rss);
+    printastring(" break "); printhex(pcb[i].sz);
+    printastring("\n");
+    int n = __atomic_load_n(&pcb[i].nvma, __ATOMIC_ACQUIRE);
+    vma **vmas = __atomic_load_n(&pcb[i].vmas, __ATOMIC_ACQUIRE);
+    for (int j=0; vmas && j<n; j++) {
+      vma *v = __atomic_load_n(&vmas[j], __ATOMIC_RELAXED);
+      printastring("  vma "); printhex(v->start);
+      printastring(" - "); printhex(v->end);
+      printastring(v->seg ? " shared " : " anonymous ");
+      printastring(v->perm & PTE_W ? "rw\n" : "r\n");
+    }
+  }
+  printastring("huge pages promoted "); printhex(thp_promotions);
+  printastring(" demoted "); printhex(thp_demotions);
+  printastring(" no 2 MB block "); printhex(thp_failed);
+  printastring("\n");
+  printastring("copy-on-write faults copied "); printhex(cow_copies);
+  printastring(" reused "); printhex(cow_reuses);
+  printastring("\n");
+  if (boot.svnapot) {
+    printastring("64 KB blocks promoted "); printhex(napot_promotions);
+    printastring(" split "); printhex(napot_splits);
+    printastring(" no 64 KB block "); printhex(napot_failed);
+    printastring("\n");
+  }
+}